@@ -0,0 +1,268 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "match.h"
+#include "search.h"
+#include "trigram.h"
+#include "util.h"
+
+#define LENGTH(x)  (sizeof (x) / sizeof *(x))
+#define MIN(a,b)   ((a) < (b) ? (a) : (b))
+#define MAX(a,b)   ((a) > (b) ? (a) : (b))
+#define MAXBYTES   (1UL << 30) /* larger corpora are skipped */
+#define NQUERIES   8
+
+typedef struct {
+	const char *name;
+	size_t (*line)(char *buf);
+} Corpus;
+
+typedef struct {
+	const char *name;
+	int (*fn)(Item *item);
+} Engine;
+
+static int cmpdouble(const void *a, const void *b);
+static void engine(const Engine *e, FILE *input, const char *corpus, size_t n);
+static size_t genlong(char *buf);
+static size_t genpath(char *buf);
+static size_t genword(char *buf);
+static double now(void);
+static unsigned long rnd(void);
+static void usage(void);
+static size_t word(char *buf);
+
+static const char *syllables[] = {
+	"ba", "ce", "di", "fo", "gu", "ha", "je", "ki", "lo", "mu", "na", "pe",
+	"qui", "ro", "sa", "te", "vi", "wo", "xa", "ye", "zo", "st", "tr", "ng",
+};
+static const char *exts[] = { "", ".c", ".h", ".txt", ".png", ".conf", ".so" };
+static const Corpus corpora[] = {
+	{ "paths", genpath },
+	{ "words", genword },
+	{ "long",  genlong },
+};
+static const Engine engines[] = {
+	{ "str",   matchstr },
+	{ "tok",   matchtok },
+	{ "fuzzy", matchfuzzy },
+};
+static unsigned long seed = 1;
+static double lat[BUFSIZ];
+static size_t nlat;
+static int dump, trigrams;
+
+int
+cmpdouble(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+void
+engine(const Engine *e, FILE *input, const char *corpus, size_t n) {
+	char q[BUFSIZ], script[NQUERIES + 1][32];
+	struct rusage ru;
+	double t, ingest, build = 0, rest = 0;
+	size_t i, j, len, off;
+	Item *item;
+
+	/* ingest the corpus the way dmenu reads stdin */
+	if (dup2(fileno(input), STDIN_FILENO) < 0 || lseek(STDIN_FILENO, 0, SEEK_SET) < 0)
+		eprintf("cannot rewind corpus:");
+	initsearch();
+	fmatch = e->fn;
+	t = now();
+	readstdin();
+	ingest = now() - t;
+	if (trigrams) {
+		t = now();
+		buildtrigrams();
+		build = now() - t;
+	}
+
+	/* queries are cut from the input, so most of them match something */
+	seed = 7;
+	for (i = 0; i < NQUERIES && nitems; i++) {
+		item = &items[rnd() % nitems];
+		off = item->len > 8 ? rnd() % (item->len - 8) : 0;
+		len = MIN(item->len - off, 8);
+		/* fuzzy queries skip every other character of a wider window */
+		for (j = 0; j < len; j++)
+			script[i][j] = item->text[off + ((e->fn == matchfuzzy) ? MIN(2 * j, item->len - off - 1) : j)];
+		script[i][j] = '\0';
+	}
+	strcpy(script[i++], "qzxjvk"); /* and one that matches nothing */
+
+	/* type each query a key at a time, then erase it */
+	for (nlat = 0; i-- > 0; ) {
+		for (len = 1; len <= strlen(script[i]) && nlat < LENGTH(lat); len++) {
+			memcpy(q, script[i], len);
+			q[len] = '\0';
+			t = now();
+			matchquery(q);
+			lat[nlat++] = now() - t;
+		}
+		if (e->fn == matchfuzzy) {
+			/* paging to the end ranks every fuzzy result */
+			t = now();
+			sortrest();
+			rest = MAX(rest, now() - t);
+		}
+		while (--len > 0 && nlat < LENGTH(lat)) {
+			q[len - 1] = '\0';
+			t = now();
+			matchquery(q);
+			lat[nlat++] = now() - t;
+		}
+	}
+	qsort(lat, nlat, sizeof *lat, cmpdouble);
+	getrusage(RUSAGE_SELF, &ru);
+	printf("corpus=%s lines=%lu engine=%s%s ingest=%.3fms keys=%lu p50=%.3fms p90=%.3fms p99=%.3fms max=%.3fms",
+	       corpus, (unsigned long)n, e->name, casefold ? "-i" : "", ingest * 1e3, (unsigned long)nlat,
+	       lat[nlat / 2] * 1e3, lat[nlat * 9 / 10] * 1e3, lat[nlat * 99 / 100] * 1e3, lat[nlat - 1] * 1e3);
+	if (e->fn == matchfuzzy)
+		printf(" sortrest=%.3fms", rest * 1e3);
+	if (trigrams)
+		printf(" trigrams=%.3fms", build * 1e3);
+	printf(" rss=%.1fMB\n", ru.ru_maxrss / 1024.0);
+}
+
+size_t
+genlong(char *buf) {
+	size_t i, n = 40 + rnd() % 160, len = 0;
+
+	for (i = 0; i < n; i++) {
+		if (i)
+			buf[len++] = ' ';
+		len += word(&buf[len]);
+	}
+	return len;
+}
+
+size_t
+genpath(char *buf) {
+	size_t i, n = 2 + rnd() % 5, len = 0;
+
+	for (i = 0; i < n; i++) {
+		buf[len++] = '/';
+		len += word(&buf[len]);
+	}
+	strcpy(&buf[len], exts[rnd() % LENGTH(exts)]);
+	return len + strlen(&buf[len]);
+}
+
+size_t
+genword(char *buf) {
+	return word(buf);
+}
+
+double
+now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+unsigned long
+rnd(void) {
+	/* the corpora must be the same on every machine */
+	seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+	return seed >> 33;
+}
+
+void
+usage(void) {
+	fputs("usage: benchmark [-i] [-T] [-w] [-n LINES]... [-c paths|words|long]... [-e str|tok|fuzzy]...\n", stderr);
+	exit(EXIT_FAILURE);
+}
+
+size_t
+word(char *buf) {
+	size_t i, n = 1 + rnd() % 4, len = 0;
+
+	for (i = 0; i < n; i++)
+		len += strlen(strcpy(&buf[len], syllables[rnd() % LENGTH(syllables)]));
+	return len;
+}
+
+int
+main(int argc, char *argv[]) {
+	size_t sizes[16], nsizes = 0, i, j, k, n, bytes;
+	const char *cnames[LENGTH(corpora)], *enames[LENGTH(engines)];
+	size_t ncnames = 0, nenames = 0;
+	char buf[BUFSIZ];
+	FILE *input;
+	int status;
+	pid_t pid;
+
+	for (i = 1; i < (size_t)argc; i++)
+		if (!strcmp(argv[i], "-i"))
+			casefold = 1;
+		else if (!strcmp(argv[i], "-w"))
+			dump = 1;
+		else if (!strcmp(argv[i], "-T"))
+			trigrams = 1;
+		else if (i + 1 == (size_t)argc)
+			usage();
+		else if (!strcmp(argv[i], "-n") && nsizes < LENGTH(sizes))
+			sizes[nsizes++] = strtoul(argv[++i], NULL, 10);
+		else if (!strcmp(argv[i], "-c") && ncnames < LENGTH(cnames))
+			cnames[ncnames++] = argv[++i];
+		else if (!strcmp(argv[i], "-e") && nenames < LENGTH(enames))
+			enames[nenames++] = argv[++i];
+		else
+			usage();
+	if (!nsizes)
+		for (n = 1000; n <= 10000000; n *= 10)
+			sizes[nsizes++] = n;
+
+	for (i = 0; i < LENGTH(corpora); i++) {
+		for (k = 0; k < ncnames && strcmp(cnames[k], corpora[i].name); k++);
+		if (ncnames && k == ncnames)
+			continue;
+		for (j = 0; j < nsizes; j++) {
+			/* write the corpus once, every engine reads it from the start */
+			if (!(input = dump ? stdout : tmpfile()))
+				eprintf("cannot create corpus:");
+			seed = 1;
+			for (n = bytes = 0; n < sizes[j] && bytes < MAXBYTES; n++) {
+				bytes += corpora[i].line(buf) + 1;
+				fputs(buf, input);
+				fputc('\n', input);
+			}
+			if (fflush(input) == EOF)
+				eprintf("cannot write corpus:");
+			if (dump)
+				continue; /* -w only writes the corpora, e.g. for xlatency */
+			if (n < sizes[j]) {
+				printf("corpus=%s lines=%lu skipped\n", corpora[i].name, (unsigned long)sizes[j]);
+				fclose(input);
+				continue;
+			}
+			for (k = 0; k < LENGTH(engines); k++) {
+				for (n = 0; n < nenames && strcmp(enames[n], engines[k].name); n++);
+				if (nenames && n == nenames)
+					continue;
+				/* a fresh process per run: clean state and its own peak RSS */
+				fflush(stdout);
+				if ((pid = fork()) < 0)
+					eprintf("cannot fork:");
+				if (pid == 0) {
+					engine(&engines[k], input, corpora[i].name, sizes[j]);
+					exit(EXIT_SUCCESS);
+				}
+				if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+					eprintf("benchmark run failed\n");
+			}
+			fclose(input);
+		}
+	}
+	return EXIT_SUCCESS;
+}
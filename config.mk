@@ -12,16 +12,25 @@ X11LIB = /usr/X11R6/lib
 XINERAMALIBS  = -lXinerama
 XINERAMAFLAGS = -DXINERAMA
 
+# MIT-SHM canvas for full-screen menus, comment if you don't want it
+SHMLIBS  = -lXext
+SHMFLAGS = -DSHM
+
 # Xft, comment if you don't want it
 XFTINC = -I/usr/include/freetype2
 XFTLIBS  = -lXft -lXrender -lfreetype -lz -lfontconfig
 
+# latency harness, run by make latency
+XTESTLIBS    = -lXtst
+XVFBDISPLAY  = 99
+LATENCYLINES = 1000000
+
 # includes and libs
 INCS = -I${X11INC} ${XFTINC}
-LIBS = -L${X11LIB} -lX11 ${XINERAMALIBS} ${XFTLIBS}
+LIBS = -L${X11LIB} -lX11 ${XINERAMALIBS} ${SHMLIBS} ${XFTLIBS} -lpthread
 
 # flags
-CPPFLAGS = -D_DEFAULT_SOURCE -D_POSIX_C_SOURCE=2 -DVERSION=\"${VERSION}\" ${XINERAMAFLAGS}
+CPPFLAGS = -D_DEFAULT_SOURCE -D_POSIX_C_SOURCE=2 -DVERSION=\"${VERSION}\" ${XINERAMAFLAGS} ${SHMFLAGS}
 #CFLAGS   = -g -std=c99 -pedantic -Wall -O0 ${INCS} ${CPPFLAGS}
 CFLAGS   = -std=c99 -pedantic -Wall -Os ${INCS} ${CPPFLAGS}
 LDFLAGS  = -s ${LIBS}
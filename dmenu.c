@@ -1,10 +1,12 @@
 /* See LICENSE file for copyright and license details. */
 #include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <strings.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/select.h>
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
 #include <X11/Xutil.h>
@@ -13,46 +15,68 @@
 #include <X11/extensions/Xinerama.h>
 #endif
 #include "draw.h"
+#include "history.h"
+#include "match.h"
+#include "search.h"
+#include "server.h"
+#include "trigram.h"
+#include "util.h"
 
 #define INTERSECT(x,y,w,h,r) (MAX(0, MIN((x)+(w),(r).x_org+(r).width)	- MAX((x),(r).x_org)) \
 							* MAX(0, MIN((y)+(h),(r).y_org+(r).height) - MAX((y),(r).y_org)))
 #define MIN(a,b)             ((a) < (b) ? (a) : (b))
 #define MAX(a,b)             ((a) > (b) ? (a) : (b))
+#define CHANGED(a,b)         ((a) != (b) && (!(a) || !(b) || strcmp((a), (b))))
 #define DEFFONT "fixed" /* xft example: "Monospace-11" */
+#define NONE ((size_t)-1) /* no result */
+typedef struct {
+	size_t n; /* result shown, or page an arrow leads to, as a position in matches */
+	int pos;  /* left edge in a horizontal list, top edge in a vertical one */
+	int len;
+} Cell;
 
-typedef struct Item Item;
-struct Item {
-	char *text;
-	Item *left, *right;
-};
-
-static void appenditem(Item *item, Item **list, Item **last);
+static void appendmatches(void);
 static void buttonpress(XEvent *e);
 static void pointermove(XEvent *e);
 static void calcoffsets(void);
 static void cleanup(void);
-static char *cistrstr(const char *s, const char *sub);
+static void createwin(void);
+static void drawinput(void);
 static void drawmenu(void);
+static void drawpage(Bool all, size_t a, size_t b);
+static size_t findmatch(uint32_t idx, size_t from);
 static void grabkeyboard(void);
 static void grabpointer(void);
+static size_t hititem(int x, int y);
+static Bool incell(const Cell *c, int pos);
 static void insert(const char *str, ssize_t n);
+static void instantmatch(void);
+static int itemw(Item *item);
 static void keypress(XKeyEvent *ev);
-static void matchstr(void);
-static void matchtok(void);
-static void matchfuzzy(void);
-static char *strchri(const char *s, int c);
+static void layoutpage(void);
+static void match(void);
+static void measureinput(void);
 static size_t nextrune(int inc);
 static size_t utf8length();
+static void parseargs(int argc, char *argv[]);
 static void paste(void);
-static void readstdin(void);
+static void readitems(void);
+static void resident(void);
 static void run(void);
+static void standby(void);
+static void timing(const char *name);
 static void setup(void);
+static void shrinkmenu(void);
 static void usage(void);
 static void read_resourses(void);
+static void warmup(void);
 static char text[BUFSIZ] = "";
 static char originaltext[BUFSIZ] = "";
 static int bh, mw, mh;
 static char *embed;
+static const char *sockpath = NULL; /* --daemon */
+static const char *indexpath = NULL, *mkindexpath = NULL;
+static const char *historypath = NULL; /* --history */
 static int inputw, promptw;
 static size_t cursor = 0;
 static const char *font = NULL;
@@ -89,12 +113,19 @@ static Bool centerx = False;
 static Bool centery = False;
 static Bool incremental = False;
 static Bool instant = False;
+static Bool streaming = False;
+static Bool timings = False;
+static Bool fast = False;
+static Bool trigrams = False;
+static struct timespec epoch, phase; /* process start, end of the last timed phase */
+static Bool exposed = False;
 static int ret = 0;
 static Bool quiet = False;
 static DC *dc;
-static Item *items = NULL;
-static Item *matches, *matchend;
-static Item *prev, *curr, *next, *sel;
+static size_t prev, curr, next, sel; /* positions in matches */
+static Cell *cells = NULL; /* geometry of the current page, built by calcoffsets() */
+static size_t ncells = 0, cellcap = 0;
+static Cell larrow, rarrow; /* page arrows of a horizontal list */
 static Window parentwin, win, dim;
 static XIC xic;
 static double opacity = 1.0, dimopacity = 0.0;
@@ -102,14 +133,65 @@ static double opacity = 1.0, dimopacity = 0.0;
 #define OPAQUE 0xffffffff
 #define OPACITY "_NET_WM_WINDOW_OPACITY"
 
-static int (*fstrncmp)(const char *, const char *, size_t) = strncmp;
-static char *(*fstrstr)(const char *, const char *) = strstr;
-static void (*match)(void) = matchstr;
-static char *(*fstrchr)(const char *, const int) = strchr;
-
 int
 main(int argc, char *argv[]) {
-	Bool fast = False;
+	clock_gettime(CLOCK_MONOTONIC, &epoch);
+	phase = epoch;
+	parseargs(argc, argv);
+	if (mkindexpath) {
+		/* no menu, just turn stdin into an index */
+		readstdin();
+		writeindex(mkindexpath);
+		return EXIT_SUCCESS;
+	}
+	if (sockpath)
+		resident();
+	else
+		warmup();
+
+	/* scores are looked up as items arrive */
+	if (historypath)
+		openhistory(historypath);
+	/* an index is there in full, nothing to stream */
+	if (indexpath)
+		streaming = False;
+	if (noinput) {
+		streaming = False;
+		grabkeyboard();
+		grabpointer();
+		timing("grab");
+	}
+	else if (streaming) {
+		/* map the window right away, run() reads stdin as it arrives */
+		grabkeyboard();
+		grabpointer();
+		timing("grab");
+	}
+	else if (fast) {
+		grabkeyboard();
+		grabpointer();
+		timing("grab");
+		readitems();
+		measureinput();
+		timing("stdin");
+	}
+	else {
+		readitems();
+		measureinput();
+		timing("stdin");
+		grabkeyboard();
+		grabpointer();
+		timing("grab");
+	}
+	setup();
+	run();
+
+	cleanup();
+	return ret;
+}
+
+void
+parseargs(int argc, char *argv[]) {
 	int i;
 
 	for (i = 1; i < argc; i++)
@@ -124,9 +206,7 @@ main(int argc, char *argv[]) {
 		else if (!strcmp(argv[i], "-f")||!strcmp(argv[i], "--fast"))
 			fast = True;
 		else if (!strcmp(argv[i], "-i")||!strcmp(argv[i], "--ignorecase")) {
-			fstrncmp = strncasecmp;
-			fstrstr = cistrstr;
-			fstrchr = strchri;
+			casefold = True;
 		}
 		/* input and typing options */
 		else if (!strcmp(argv[i], "-q")||!strcmp(argv[i], "--quiet"))
@@ -141,11 +221,17 @@ main(int argc, char *argv[]) {
 			noinput = True;
 		else if (!strcmp(argv[i], "-N")||!strcmp(argv[i], "--incremental"))
 			incremental = True;
+		else if (!strcmp(argv[i], "-s")||!strcmp(argv[i], "--stream"))
+			streaming = True;
+		else if (!strcmp(argv[i], "--timings"))
+			timings = True;
+		else if (!strcmp(argv[i], "--trigrams"))
+			trigrams = True;
 		/* matching styles */
 		else if (!strcmp(argv[i], "-z")||!strcmp(argv[i], "--fuzzy"))
-			match = matchfuzzy;
+			fmatch = matchfuzzy;
 		else if (!strcmp(argv[i], "-t")||!strcmp(argv[i], "--token"))
-			match = matchtok;
+			fmatch = matchtok;
 		/* ui options */
 		else if (!strcmp(argv[i], "-V")||!strcmp(argv[i], "--vertfull"))
 			vertfull = True;
@@ -208,35 +294,19 @@ main(int argc, char *argv[]) {
 		/* etc. */
 		else if (!strcmp(argv[i], "-so")||!strcmp(argv[i], "--scrolloff"))
 			scrolloff = atoi(argv[++i]);
+		/* resident mode */
+		else if (!strcmp(argv[i], "--daemon"))
+			sockpath = argv[++i];
+		/* binary item index */
+		else if (!strcmp(argv[i], "--index"))
+			indexpath = argv[++i];
+		else if (!strcmp(argv[i], "--mkindex"))
+			mkindexpath = argv[++i];
+		/* frecency ranking */
+		else if (!strcmp(argv[i], "--history"))
+			historypath = argv[++i];
 		else
 			usage();
-
-	dc = initdc();
-	read_resourses();
-	initfont(dc, font ? font : DEFFONT);
-	normcol = initcolor(dc, normfgcolor, normbgcolor);
-	selcol = initcolor(dc, selfgcolor, selbgcolor);
-	dimcol = initcolor(dc, dimcolor, dimcolor);
-
-	if (noinput) {
-		grabkeyboard();
-		grabpointer();
-	}
-	else if (fast) {
-		grabkeyboard();
-		grabpointer();
-		readstdin();
-	}
-	else {
-		readstdin();
-		grabkeyboard();
-		grabpointer();
-	}
-	setup();
-	run();
-
-	cleanup();
-	return ret;
 }
 
 /* Set font and colors from X resources database if they are not set
@@ -284,15 +354,36 @@ read_resourses(void) {
 }
 
 void
-appenditem(Item *item, Item **list, Item **last) {
-	if (*last)
-		(*last)->right = item;
-	else
-		*list = item;
-
-	item->left = *last;
-	item->right = NULL;
-	*last = item;
+appendmatches(void) {
+	static size_t max = 0;
+	size_t i, n = nitems, had = nmatches;
+	uint32_t top = had ? matches[curr] : 0, picked = had ? matches[sel] : 0;
+	int more = readmatches();
+
+	/* widen the input field for the lines that just arrived */
+	if (!more) {
+		streaming = False;
+		instantmatch();
+		if (trigrams)
+			buildtrigrams();
+	}
+	if (nitems > n) {
+		for (i = n; i < nitems; i++)
+			if (items[i].len > max) {
+				max = items[i].len;
+				inputw = MIN(itemw(&items[i]), mw/3);
+			}
+		/* keep the page and the selection on the same results */
+		if (had) {
+			curr = findmatch(top, curr);
+			sel = findmatch(picked, sel);
+		}
+		calcoffsets();
+	}
+	if (!more)
+		shrinkmenu();
+	if (nitems > n || !more)
+		drawmenu();
 }
 
 void
@@ -304,22 +395,19 @@ calcoffsets(void) {
 	else
 		n = mw - (promptw + inputw + textw(dc, "<") + textw(dc, ">"));
 	/* calculate which items will begin the next page and previous page */
-	for (i = 0, next = curr; next; next = next->right)
-		if ((i += (lines > 0) ? bh : MIN(textw(dc, next->text), n)) > n)
+	for (i = 0, next = curr; next < nmatches; next++)
+		if ((i += (lines > 0) ? bh : MIN(itemw(MATCH(next)), n)) > n)
 			break;
-	for (i = 0, prev = curr; prev && prev->left; prev = prev->left)
-		if ((i += (lines > 0) ? bh : MIN(textw(dc, prev->left->text), n)) > n)
+	for (i = 0, prev = curr; prev > 0; prev--)
+		if ((i += (lines > 0) ? bh : MIN(itemw(MATCH(prev - 1)), n)) > n)
 			break;
-}
-
-char *
-cistrstr(const char *s, const char *sub) {
-	size_t len;
-
-	for (len = strlen(sub); *s; s++)
-		if (!strncasecmp(s, sub, len))
-			return (char *)s;
-	return NULL;
+	/* this page reaches the unranked fuzzy results: rank them now */
+	if (!restsorted && tiersize[1] && next >= tiersize[0]) {
+		sortrest();
+		calcoffsets();
+		return;
+	}
+	layoutpage();
 }
 
 void
@@ -349,65 +437,137 @@ createmaskinput(char *maskinput, int length)
 }
 
 void
-drawmenu(void) {
+createwin(void) {
+	XSetWindowAttributes swa;
+	XIM xim;
+
+	/* created unmapped; setup() places, sizes and colors it */
+	clip = XInternAtom(dc->dpy, "CLIPBOARD",   False);
+	utf8 = XInternAtom(dc->dpy, "UTF8_STRING", False);
+	swa.override_redirect = True;
+	swa.event_mask = ExposureMask | KeyPressMask | VisibilityChangeMask | ButtonPressMask | PointerMotionMask;
+	win = XCreateWindow(dc->dpy, DefaultRootWindow(dc->dpy), 0, 0, 1, 1, 0,
+						CopyFromParent, CopyFromParent, CopyFromParent,
+						CWOverrideRedirect | CWEventMask, &swa);
+
+	/* open input methods */
+	xim = XOpenIM(dc->dpy, NULL, NULL, NULL);
+	xic = XCreateIC(xim, XNInputStyle, XIMPreeditNothing | XIMStatusNothing,
+					XNClientWindow, win, XNFocusWindow, win, NULL);
+}
+
+void
+drawinput(void) {
 	int curpos;
 	char maskinput[sizeof text];
 	int length = maskin ? utf8length() : cursor;
-	Item *item;
 
-	dc->x = 0;
+	dc->x = (prompt && *prompt) ? promptw : 0;
 	dc->y = 0;
 	dc->h = bh;
-	drawrect(dc, 0, 0, mw, mh, True, normcol->BG);
+	dc->w = (lines > 0 || !nmatches) ? mw - dc->x : inputw;
+	drawtext(dc, maskin ? createmaskinput(maskinput, length) : text, normcol);
+	if ((curpos = textnw(dc, maskin ? maskinput : text, length) + dc->font.height/2) < dc->w)
+		drawrect(dc, curpos, (dc->h - dc->font.height)/2 + 1, 1, dc->font.height -1, True, normcol->FG);
+}
 
-	if (prompt && *prompt) {
-		dc->w = promptw;
-		drawtext(dc, prompt, selcol);
-		dc->x = dc->w;
+void
+drawmenu(void) {
+	static char drawntext[sizeof text];
+	static size_t drawncurr, drawnnext, drawnsel;
+	static size_t drawncursor;
+	static unsigned long drawnserial = 0;
+	static int drawnmh;
+
+	if (drawnserial && listserial == drawnserial && mh == drawnmh && curr == drawncurr
+	&& next == drawnnext && !strcmp(text, drawntext)) {
+		/* only the selection or the cursor moved: repaint just those */
+		if (sel != drawnsel && (!quiet || strlen(text) > 0))
+			drawpage(False, drawnsel, sel);
+		if (cursor != drawncursor && !horzfull)
+			drawinput();
 	}
-	if (horzfull)
-		drawrect(dc, dc->x, dc->y, mw, dc->h, True, selcol->BG);
-
-	/* draw input field */
-	if (!horzfull) {
-		dc->w = (lines > 0 || !matches) ? mw - dc->x : inputw;
-		drawtext(dc, maskin ? createmaskinput(maskinput, length) : text, normcol);
-		if ((curpos = textnw(dc, maskin ? maskinput : text, length) + dc->font.height/2) < dc->w)
-			drawrect(dc, curpos, (dc->h - dc->font.height)/2 + 1, 1, dc->font.height -1, True, normcol->FG);
+	else {
+		dc->x = 0;
+		dc->y = 0;
+		dc->h = bh;
+		drawrect(dc, 0, 0, mw, mh, True, normcol->BG);
+
+		if (prompt && *prompt) {
+			dc->w = promptw;
+			drawtext(dc, prompt, selcol);
+			dc->x = dc->w;
+		}
+		if (horzfull)
+			drawrect(dc, dc->x, dc->y, mw, dc->h, True, selcol->BG);
+		else
+			drawinput();
+		if (!quiet || strlen(text) > 0)
+			drawpage(True, NONE, NONE);
 	}
+	strcpy(drawntext, text);
+	drawncurr = curr;
+	drawnnext = next;
+	drawnsel = sel;
+	drawncursor = cursor;
+	drawnserial = listserial;
+	drawnmh = mh;
+	mapdc(dc, win, mw, mh);
+}
+
+void
+drawpage(Bool all, size_t a, size_t b) {
+	size_t i;
 
-	if (!quiet || strlen(text) > 0) {	
-		if (lines > 0) {
-			/* draw vertical list */
-			if (vertfull) {
-				dc->x = 0;
-				drawrect(dc, dc->x, dc->y + dc->h + 2, mw, 1, True, normcol->BG);
-				dc->y += 1;
+	/* draw every item on the page, or only a and b */
+	dc->y = 0;
+	dc->h = bh;
+	if (lines > 0) {
+		/* draw vertical list */
+		dc->x = vertfull ? 0 : promptw;
+		dc->w = mw - dc->x;
+		if (vertfull && all)
+			drawrect(dc, dc->x, dc->y + dc->h + 2, mw, 1, True, normcol->BG);
+		for (i = 0; i < ncells; i++)
+			if (all || cells[i].n == a || cells[i].n == b) {
+				dc->y = cells[i].pos;
+				drawcached(dc, MATCH(cells[i].n)->text, (cells[i].n == sel) ? selcol : normcol);
 			}
-			dc->w = mw - dc->x;
-			for (item = curr; item != next; item = item->right) {
-				dc->y += dc->h;
-				drawtext(dc, item->text, (item == sel) ? selcol : normcol);
+	}
+	else if (nmatches) {
+		/* draw horizontal list */
+		for (i = 0; i < ncells; i++)
+			if (all || cells[i].n == a || cells[i].n == b) {
+				dc->x = cells[i].pos;
+				dc->w = cells[i].len;
+				drawcached(dc, MATCH(cells[i].n)->text, (cells[i].n == sel) ? selcol : normcol);
 			}
+		if (all && larrow.n != NONE) {
+			dc->x = larrow.pos;
+			dc->w = larrow.len;
+			drawtext(dc, "<", normcol);
 		}
-		else if (matches) {
-			/* draw horizontal list */
-			dc->x += inputw;
-			dc->w = textw(dc, "<");
-			if (curr->left)
-				drawtext(dc, "<", normcol);
-			for (item = curr; item != next; item = item->right) {
-				dc->x += dc->w;
-				dc->w = MIN(textw(dc, item->text), mw - dc->x - textw(dc, ">"));
-				drawtext(dc, item->text, (item == sel) ? selcol : normcol);
-			}
-			dc->w = textw(dc, ">");
-			dc->x = mw - dc->w;
-			if (next)
-				drawtext(dc, ">", normcol);
+		if (all && rarrow.n != NONE) {
+			dc->x = rarrow.pos;
+			dc->w = rarrow.len;
+			drawtext(dc, ">", normcol);
 		}
 	}
-	mapdc(dc, win, mw, mh);
+}
+
+size_t
+findmatch(uint32_t idx, size_t from) {
+	size_t i;
+
+	/* where a result went after new input was matched: results only
+	 * gain others ahead of them, unless they were ranked anew */
+	for (i = from; i < nmatches; i++)
+		if (matches[i] == idx)
+			return i;
+	for (i = 0; i < MIN(from, nmatches); i++)
+		if (matches[i] == idx)
+			return i;
+	return 0;
 }
 
 void
@@ -435,6 +595,27 @@ void grabpointer(void) {
 	eprintf("cannot grab pointer\n");
 }
 
+size_t
+hititem(int x, int y) {
+	size_t lo = 0, hi = ncells, mid;
+	int pos = (lines > 0) ? y : x;
+
+	/* the cells are sorted along the list, find the last one starting at pos or before */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (cells[mid].pos <= pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo > 0 && incell(&cells[lo-1], pos)) ? cells[lo-1].n : NONE;
+}
+
+Bool
+incell(const Cell *c, int pos) {
+	return c->n != NONE && pos >= c->pos && pos < c->pos + c->len;
+}
+
 void
 insert(const char *str, ssize_t n) {
 	if (strlen(text) + n > sizeof text - 1)
@@ -447,6 +628,33 @@ insert(const char *str, ssize_t n) {
 	match();
 }
 
+int
+itemw(Item *item) {
+	static unsigned int serial = 0;
+	size_t i;
+
+	/* widths are measured once per font */
+	if (serial != dc->font.serial) {
+		for (i = 0; i < nitems; i++)
+			items[i].width = 0;
+		serial = dc->font.serial;
+	}
+	if (!item->width)
+		item->width = textw(dc, item->text);
+	return item->width;
+}
+
+void
+instantmatch(void) {
+	/* a unique match is only final once all of stdin has been read */
+	if (instant && !streaming && nmatches == 1 && !tiersize[2]) {
+		puts(MATCH(0)->text);
+		recordhistory(MATCH(0)->text);
+		cleanup();
+		exit(0);
+	}
+}
+
 void
 keypress(XKeyEvent *ev) {
 	char buf[32];
@@ -531,30 +739,33 @@ keypress(XKeyEvent *ev) {
 			cursor = strlen(text);
 			break;
 		}
-		if (next) {
+		sortrest();
+		if (next < nmatches) {
 			/* jump to end of list and position items in reverse */
-			curr = matchend;
+			curr = nmatches - 1;
 			calcoffsets();
 			curr = prev;
 			calcoffsets();
-			while (next && (curr = curr->right))
+			while (next < nmatches) {
+				curr++;
 				calcoffsets();
+			}
 		}
-		sel = matchend;
+		sel = nmatches ? nmatches - 1 : 0;
 		break;
 	case XK_Escape:
 		ret = EXIT_FAILURE;
 		running = False;
 	case XK_Home:
-		if (sel == matches) {
+		if (sel == 0) {
 			cursor = 0;
 			break;
 		}
-		sel = curr = matches;
+		sel = curr = 0;
 		calcoffsets();
 		break;
 	case XK_Left:
-		if (cursor > 0 && (!sel || !sel->left || lines > 0)) {
+		if (cursor > 0 && (sel == 0 || lines > 0)) {
 			cursor = nextrune(-1);
 			break;
 		}
@@ -562,34 +773,41 @@ keypress(XKeyEvent *ev) {
 			return;
 		/* fallthrough */
 	case XK_Up:
-		if (sel && sel->left && (sel = sel->left)->right == curr) {
+		if (sel > 0 && sel-- == curr) {
 			curr = prev;
 			calcoffsets();
 		}
 		break;
 	case XK_Next:
-		if (!next)
+		if (next >= nmatches)
 			return;
 		sel = curr = next;
 		calcoffsets();
 		break;
 	case XK_Prior:
-		if (!prev)
+		if (!nmatches)
 			return;
 		sel = curr = prev;
 		calcoffsets();
 		break;
 	case XK_Return:
 	case XK_KP_Enter:
-		if ((ev->state & ShiftMask) || !sel)
+		if ((ev->state & ShiftMask) || !nmatches) {
 			puts(text);
-		else if (!filter)
-			puts(sel->text);
+			/* remember items only, not typos and one-off input */
+			if (nmatches && !strcmp(text, MATCH(sel)->text))
+				recordhistory(text);
+		}
+		else if (!filter) {
+			puts(MATCH(sel)->text);
+			recordhistory(MATCH(sel)->text);
+		}
 		else {
-			for (Item *item = sel; item; item = item->right)
-				puts(item->text);
-			for (Item *item = matches; item != sel; item = item->right)
-				puts(item->text);
+			sortrest();
+			for (size_t i = sel; i < nmatches; i++)
+				puts(MATCH(i)->text);
+			for (size_t i = 0; i < sel; i++)
+				puts(MATCH(i)->text);
 		}
 		ret = EXIT_SUCCESS;
 		running = False;
@@ -603,22 +821,22 @@ keypress(XKeyEvent *ev) {
 			return;
 		/* fallthrough */
 	case XK_Down:
-		if (sel && sel->right && (sel = sel->right) == next) {
+		if (sel + 1 < nmatches && ++sel == next) {
 			curr = next;
 			calcoffsets();
 		}
 		break;
 	case XK_Tab:
-		if (!sel)
+		if (!nmatches)
 			return;
-		if (strcmp(text, sel->text)) {
+		if (strcmp(text, MATCH(sel)->text)) {
 			strncpy(originaltext, text, sizeof originaltext);
-			strncpy(text, sel->text, sizeof text);
+			strncpy(text, MATCH(sel)->text, sizeof text);
 			cursor = strlen(text);
 		} else {
-			if (sel && sel->right) {
-				sel = sel->right;
-				strncpy(text, sel->text, sizeof text);
+			if (sel + 1 < nmatches) {
+				sel++;
+				strncpy(text, MATCH(sel)->text, sizeof text);
 				cursor = strlen(text);
 			}
 			else {
@@ -629,17 +847,18 @@ keypress(XKeyEvent *ev) {
 		}
 		break;
 	case XK_ISO_Left_Tab:
-		if (!sel)
+		if (!nmatches)
 			return;
-		if (strcmp(text, sel->text)) {
-			sel = matchend;
+		if (strcmp(text, MATCH(sel)->text)) {
+			sortrest();
+			sel = nmatches - 1;
 			strncpy(originaltext, text, sizeof originaltext);
-			strncpy(text, sel->text, sizeof text);
+			strncpy(text, MATCH(sel)->text, sizeof text);
 			cursor = strlen(text);
 		} else {
-			if (sel && sel->left) {
-				sel = sel->left;
-				strncpy(text, sel->text, sizeof text);
+			if (sel > 0) {
+				sel--;
+				strncpy(text, MATCH(sel)->text, sizeof text);
 				cursor = strlen(text);
 			}
 			else {
@@ -657,88 +876,31 @@ keypress(XKeyEvent *ev) {
 	drawmenu();
 }
 
-char *
-strchri(const char *s, int c) {
-	char *u, *l;
-	if (!isalpha(c)) return strchr(s, c);
-	if (isupper(c)) {
-		u = strchr(s, c);
-		l = strchr(s, tolower(c));
-	}
-	else {
-		l = strchr(s, c);
-		u = strchr(s, toupper(c));
-	}
-
-	return u == NULL? l : u;
-}
-
 void
 pointermove(XEvent *e) {
-	int curpos;
-	Item *item;
+	size_t n;
 	XPointerMovedEvent *ev = &e->xmotion;
 
-	dc->x = 0;
-	dc->y = 0;
-	dc->h = bh;
-
-	if (prompt && *prompt) {
-		dc->w = promptw;
-		dc->x = dc->w;
-	}
-
-	dc->w = (lines > 0 || !matches) ? mw - dc->x : inputw;
-	if ((curpos = textnw(dc, text, cursor) +dc->h/2 - 2) < dc->w);
-
-	if (lines > 0) {
-		/* vertical list: highlight */
-		dc->w = mw - dc->x;
-		for (item = curr; item != next; item = item->right) {
-			dc->y += dc->h;
-			if (ev->y >= dc->y && ev->y <= (dc->y + dc->h)) {
-				sel = item;
-				drawmenu();
-			}
-		}
-	}
-	else if (matches) {
-		/* reached left end, page back */
-		dc->x += inputw;
-		dc->w = textw(dc, "<");
-		if (prev && curr->left) {
-			if (ev->x >= dc->x && ev->x <= dc->x + dc->w) {
-				sel = curr = prev;
-				calcoffsets();
-				drawmenu();
-				return;
-			}
-		}
-		/* horizontal list: highlight */
-		for (item = curr; item != next; item = item->right) {
-		dc->x += dc->w;
-			dc->w = MIN(textw(dc, item->text), mw - dc->x - textw(dc, ">"));
-			if (ev->x >= dc->x && ev->x <= (dc->x + dc->w)) {
-				sel = item;
-				drawmenu();
-			}
-		}
-		/* reached right end, page forward */
-		dc->w = textw(dc, ">");
-		dc->x = mw - dc->w;
-		if (next && ev->x >= dc->x && ev->x <= dc->x + dc->w) {
-			sel = curr = next;
+	if (lines == 0) {
+		/* reached either end, page back or forward */
+		if (incell(&larrow, ev->x) || incell(&rarrow, ev->x)) {
+			sel = curr = incell(&larrow, ev->x) ? prev : next;
 			calcoffsets();
 			drawmenu();
 			return;
 		}
 	}
+	/* highlight, but only redraw when the hovered item changes */
+	if ((n = hititem(ev->x, ev->y)) != NONE && n != sel) {
+		sel = n;
+		drawmenu();
+	}
 }
 
 void
 buttonpress(XEvent *e) {
 	int curpos;
-	Item *item;
+	size_t n;
 	XButtonPressedEvent *ev = &e->xbutton;	
 
 	if (ev->window != win)
@@ -757,7 +919,7 @@ buttonpress(XEvent *e) {
 		dc->x = dc->w;
 	}
 	/* input field */
-	dc->w = (lines > 0 || !matches) ? mw - dc->x : inputw;
+	dc->w = (lines > 0 || !nmatches) ? mw - dc->x : inputw;
 	if ((curpos = textnw(dc, text, cursor) + dc->h/2 - 2) < dc->w);
 
 	/* left-click on input: clear input,
@@ -765,7 +927,7 @@ buttonpress(XEvent *e) {
 	 *       add that to the input width */
 	if (ev->button == Button1 &&
 		((lines <= 0 && ev->x >= 0 && ev->x <= dc->x + dc->w +
-		((!prev || !curr->left) ? textw(dc, "<") : 0)) ||
+		((curr == 0) ? textw(dc, "<") : 0)) ||
 		(lines > 0 && ev->y >= dc->y && ev->y <= dc->y + dc->h))) {
 		insert(NULL, 0 - cursor);
 		drawmenu();
@@ -778,12 +940,12 @@ buttonpress(XEvent *e) {
 		return;
 	}
 	/* scroll up */
-	if (ev->button == Button4 && prev) {
+	if (ev->button == Button4 && nmatches) {
 		if (scrolloff) {
 			int i = 0;
-			while (++i < scrolloff && sel && sel->left && curr && curr->left) {
-				curr = curr->left;
-				sel = sel->left;
+			while (++i < scrolloff && sel > 0 && curr > 0) {
+				curr--;
+				sel--;
 			}
 		} else
 			sel = curr = prev;
@@ -792,12 +954,12 @@ buttonpress(XEvent *e) {
 		return;
 	}
 	/* scroll down */
-	if (ev->button == Button5 && next) {
+	if (ev->button == Button5 && next < nmatches) {
 		if (scrolloff) {
 			int i = 0;
-			while (++i < scrolloff && sel && sel->right && curr && curr->right) {
-				curr = curr->right;
-				sel = sel->right;
+			while (++i < scrolloff && sel + 1 < nmatches && curr + 1 < nmatches) {
+				curr++;
+				sel++;
 			}
 		} else
 			sel = curr = next;
@@ -807,163 +969,80 @@ buttonpress(XEvent *e) {
 	}
 	if (ev->button != Button1)
 		return;
-	if (lines > 0) {
-		/* vertical list: left-click on item */
-		dc->w = mw - dc->x;
-		for (item = curr; item != next; item = item->right) {
-			dc->y += dc->h;
-			if (ev->y >= dc->y && ev->y <= (dc->y + dc->h)) {
-				puts(item->text);
-				exit(EXIT_SUCCESS);
-			}
-		}
-	}
-	else if (matches) {
-		/* left-click on left arrow */
-		dc->x += inputw;
-		dc->w = textw(dc, "<");
-		if (prev && curr->left) {
-			if (ev->x >= dc->x && ev->x <= dc->x + dc->w) {
-				sel = curr = prev;
-				calcoffsets();
-				drawmenu();
-				return;
-			}
-		}
-		/* horizontal list: left-click on item */
-		for (item = curr; item != next; item = item->right) {
-		dc->x += dc->w;
-			dc->w = MIN(textw(dc, item->text), mw - dc->x - textw(dc, ">"));
-			if (ev->x >= dc->x && ev->x <= (dc->x + dc->w)) {
-				puts(item->text);
-				exit(EXIT_SUCCESS);
-			}
-		}
-		/* left-click on right arrow */
-		dc->w = textw(dc, ">");
-		dc->x = mw - dc->w;
-		if (next && ev->x >= dc->x && ev->x <= dc->x + dc->w) {
-			sel = curr = next;
+	if (lines == 0) {
+		/* left-click on either arrow */
+		if (incell(&larrow, ev->x) || incell(&rarrow, ev->x)) {
+			sel = curr = incell(&larrow, ev->x) ? prev : next;
 			calcoffsets();
 			drawmenu();
 			return;
 		}
 	}
+	/* left-click on item */
+	if ((n = hititem(ev->x, ev->y)) != NONE) {
+		puts(MATCH(n)->text);
+		recordhistory(MATCH(n)->text);
+		exit(EXIT_SUCCESS);
+	}
 }
 
 void
-matchstr(void) {
-	static char **tokv = NULL;
-	static int tokn = 0;
-
-	char buf[sizeof text], *s;
-	int i, tokc = 0;
-	size_t len;
-	Item *item, *lprefix, *lsubstr, *prefixend, *substrend;
-
-	strcpy(buf, text);
-	/* separate input text into tokens to be matched individually */
-	for (s = strtok(buf, " "); s; tokv[tokc-1] = s, s = strtok(NULL, " "))
-		if (++tokc > tokn && !(tokv = realloc(tokv, ++tokn * sizeof *tokv)))
-			eprintf("cannot realloc %u bytes\n", tokn * sizeof *tokv);
-	len = tokc ? strlen(tokv[0]) : 0;
-
-	matches = lprefix = lsubstr = matchend = prefixend = substrend = NULL;
-	for (item = items; item && item->text; item++) {
-		for (i = 0; i < tokc; i++)
-			if (!fstrstr(item->text, tokv[i]))
-				break;
-		if (i != tokc) /* not all tokens match */
-			continue;
-		/* exact matches go first, then prefixes, then substrings */
-		if (!tokc || !fstrncmp(tokv[0], item->text, len+1))
-			appenditem(item, &matches, &matchend);
-		else if (!fstrncmp(tokv[0], item->text, len))
-			appenditem(item, &lprefix, &prefixend);
-		else
-			appenditem(item, &lsubstr, &substrend);
-	}
-	if (lprefix) {
-		if (matches) {
-			matchend->right = lprefix;
-			lprefix->left = matchend;
-		}
-		else
-			matches = lprefix;
-		matchend = prefixend;
-	}
-	if (lsubstr) {
-		if (matches) {
-			matchend->right = lsubstr;
-			lsubstr->left = matchend;
+layoutpage(void) {
+	size_t i;
+	int x, y, w;
+
+	/* lay out the page once, drawing and hit tests reuse it */
+	ncells = 0;
+	larrow.n = rarrow.n = NONE;
+	if (lines == 0 && !nmatches)
+		return;
+	ncells = next - curr;
+	if (ncells > cellcap && !(cells = realloc(cells, (cellcap = ncells) * sizeof *cells)))
+		eprintf("cannot realloc %u bytes:", cellcap * sizeof *cells);
+	ncells = 0;
+	if (lines > 0) {
+		for (y = vertfull ? 1 : 0, i = curr; i < next; i++) {
+			y += bh;
+			cells[ncells].n = i;
+			cells[ncells].pos = y;
+			cells[ncells++].len = bh;
 		}
-		else
-			matches = lsubstr;
-		matchend = substrend;
+		return;
 	}
-	curr = sel = matches;
-	if (instant && matches && matches==matchend && !lsubstr) {
-		puts(matches->text);
-		cleanup();
-		exit(0);
+	x = promptw + inputw;
+	larrow.n = curr > 0 ? prev : NONE;
+	larrow.pos = x;
+	larrow.len = w = textw(dc, "<");
+	rarrow.len = textw(dc, ">");
+	rarrow.pos = mw - rarrow.len;
+	rarrow.n = next < nmatches ? next : NONE;
+	for (i = curr; i < next; i++) {
+		x += w;
+		w = MIN(itemw(MATCH(i)), mw - x - rarrow.len);
+		cells[ncells].n = i;
+		cells[ncells].pos = x;
+		cells[ncells++].len = w;
 	}
-	calcoffsets();
 }
 
 void
-matchtok(void) {
-	char buf[sizeof text];
-	char **tokv, *s;
-	int tokc, i;
-	Item *item, *end;
-
-	tokc = 0;
-	tokv = NULL;
-	strcpy(buf, text);
-	for (s = strtok(buf, " "); s; tokv[tokc-1] = s, s = strtok(NULL, " "))
-		if (!(tokv = realloc(tokv, ++tokc * sizeof *tokv)))
-			eprintf("cannot realloc %u bytes\n", tokc * sizeof *tokv);
-
-	matches = end = NULL;
-	for (item = items; item->text; item++) {
-		for (i = 0; i < tokc; i++)
-			if (!fstrstr(item->text, tokv[i]))
-				break;
-		if (i == tokc)
-			appenditem(item, &matches, &end);
-	}
-	free(tokv);
-	curr = prev = next = sel = matches;
-	if (instant && matches && matches==matchend) {
-		puts(matches->text);
-		cleanup();
-		exit(0);
-	}
+match(void) {
+	matchquery(text);
+	curr = sel = 0;
+	instantmatch();
 	calcoffsets();
 }
 
 void
-matchfuzzy(void) {
-	int i;
-	size_t len;
-	Item *item;
-	char *pos;
-
-	len = strlen(text);
-	matches = matchend = NULL;
-	for (item = items; item && item->text; item++) {
-		i = 0;
-		for (pos = fstrchr(item->text, text[i]); pos && text[i]; i++, pos = fstrchr(pos+1, text[i]));
-		if (i == len) appenditem(item, &matches, &matchend);
-	}
-
-	curr = sel = matches;
-	if (instant && matches && matches==matchend) {
-		puts(matches->text);
-		cleanup();
-		exit(0);
-	}
-	calcoffsets();
+measureinput(void) {
+	Item *widest = NULL;
+	size_t i, max = 0;
+
+	for (i = 0; i < nitems; i++)
+		if (items[i].len > max)
+			max = items[i].len, widest = &items[i];
+	inputw = max ? itemw(widest) : 0;
+	lines = MIN(lines, nitems);
 }
 
 size_t
@@ -1005,33 +1084,68 @@ paste(void) {
 }
 
 void
-readstdin(void) {
-	char buf[sizeof text], *p, *maxstr = NULL;
-	size_t i, max = 0, size = 0;
-
-	/* read each line from stdin and add it to the item list */
-	for (i = 0; fgets(buf, sizeof buf, stdin); i++) {
-		if (i+1 >= size / sizeof *items)
-			if (!(items = realloc(items, (size += BUFSIZ))))
-				eprintf("cannot realloc %u bytes:", size);
-		if ((p = strchr(buf, '\n')))
-			*p = '\0';
-		if (!(items[i].text = strdup(buf)))
-			eprintf("cannot strdup %u bytes:", strlen(buf)+1);
-		if (strlen(items[i].text) > max)
-			max = strlen(maxstr = items[i].text);
+readitems(void) {
+	if (indexpath)
+		readindex(indexpath);
+	else
+		readstdin();
+	if (trigrams)
+		buildtrigrams();
+}
+
+void
+resident(void) {
+	static char buf[1 << 16];
+	char *args[1024];
+	const char *oldfont = font, *oldcolors[] = { normfgcolor, normbgcolor, selfgcolor, selbgcolor, dimcolor };
+	int conn, argc;
+
+	conn = serve(sockpath, standby);
+	/* a client connected: startup is timed from here */
+	clock_gettime(CLOCK_MONOTONIC, &epoch);
+	phase = epoch;
+	if ((argc = request(conn, buf, sizeof buf, args, sizeof args / sizeof *args)) < 0)
+		eprintf("bad request\n");
+	close(conn);
+	/* the client's options go over the daemon's, reload only what differs */
+	parseargs(argc, args);
+	if (CHANGED(font, oldfont))
+		initfont(dc, font ? font : DEFFONT);
+	if (CHANGED(font, oldfont) || CHANGED(normfgcolor, oldcolors[0]) || CHANGED(normbgcolor, oldcolors[1])
+	|| CHANGED(selfgcolor, oldcolors[2]) || CHANGED(selbgcolor, oldcolors[3]) || CHANGED(dimcolor, oldcolors[4])) {
+		freecol(dc, normcol);
+		freecol(dc, selcol);
+		freecol(dc, dimcol);
+		normcol = initcolor(dc, normfgcolor, normbgcolor);
+		selcol = initcolor(dc, selfgcolor, selbgcolor);
+		dimcol = initcolor(dc, dimcolor, dimcolor);
 	}
-	if (items)
-		items[i].text = NULL;
-	inputw = maxstr ? textw(dc, maxstr) : 0;
-	lines = MIN(lines, i);
+	timing("request");
 }
 
 void
 run(void) {
 	XEvent ev;
-
-	while (running && !XNextEvent(dc->dpy, &ev)) {
+	fd_set fds;
+	int xfd = ConnectionNumber(dc->dpy);
+
+	while (running) {
+		/* while stdin is still open, wait on it and the X connection */
+		if (streaming && !XPending(dc->dpy)) {
+			FD_ZERO(&fds);
+			FD_SET(xfd, &fds);
+			FD_SET(STDIN_FILENO, &fds);
+			if (select(MAX(xfd, STDIN_FILENO) + 1, &fds, NULL, NULL, NULL) < 0) {
+				if (errno == EINTR)
+					continue;
+				eprintf("cannot select:");
+			}
+			if (FD_ISSET(STDIN_FILENO, &fds))
+				appendmatches();
+			continue;
+		}
+		if (XNextEvent(dc->dpy, &ev))
+			break;
 		if (XFilterEvent(&ev, win))
 			continue;
 		switch(ev.type) {
@@ -1044,8 +1158,18 @@ run(void) {
 			buttonpress(&ev);
 			break;
 		case Expose:
-			if (ev.xexpose.count == 0)
+			damagedc(dc, ev.xexpose.x, ev.xexpose.y, ev.xexpose.width, ev.xexpose.height);
+			if (ev.xexpose.count == 0) {
 				mapdc(dc, win, mw, mh);
+				if (!exposed) {
+					/* the window is on screen: time the wait and the whole startup */
+					exposed = True;
+					XFlush(dc->dpy);
+					timing("expose");
+					phase = epoch;
+					timing("startup");
+				}
+			}
 			break;
 		case KeyPress:
 			keypress(&ev.xkey);
@@ -1069,7 +1193,6 @@ setup(void) {
 	int dimx, dimy, dimw, dimh;
 	Window root = RootWindow(dc->dpy, screen);
 	XSetWindowAttributes swa;
-	XIM xim;
 
 #ifdef XINERAMA
 	XineramaScreenInfo *info;
@@ -1079,9 +1202,6 @@ setup(void) {
 	unsigned int du;
 #endif
 
-	clip = XInternAtom(dc->dpy, "CLIPBOARD",   False);
-	utf8 = XInternAtom(dc->dpy, "UTF8_STRING", False);
-
 	if (!embed || !(parentwin = strtol(embed, NULL, 0)))
 		parentwin = root;
 	if (!XGetWindowAttributes(dc->dpy, parentwin, &wa))
@@ -1133,8 +1253,8 @@ setup(void) {
 		sh = wa.height;
 	}
 
-	/* calculate geometry */
-	if (width == 0) {
+	/* calculate geometry; nothing has been read yet when streaming */
+	if (width == 0 && !streaming) {
 		mw = inputw;
 	} else {
 		mw = (width > 0) ? width : sw;
@@ -1154,6 +1274,7 @@ setup(void) {
 	}
 
 	promptw = (prompt && *prompt) ? textw(dc, prompt) : 0;
+	pagesize = (lines > 0) ? lines : mw / MAX(dc->font.height, 1) + 1;
 	if (horzfull)
 		mw = promptw = MAX(promptw, mw);
 
@@ -1212,12 +1333,11 @@ setup(void) {
 		XMapRaised(dc->dpy, dim);
 	}
 
-	/* create menu window */
-	swa.background_pixel = normcol->BG;
-	swa.event_mask = ExposureMask | KeyPressMask | VisibilityChangeMask | ButtonPressMask | PointerMotionMask;
-	win = XCreateWindow(dc->dpy, root, mx, my, mw, mh, 0,
-						CopyFromParent, CopyFromParent, CopyFromParent,
-						CWOverrideRedirect | CWBackPixel | CWEventMask, &swa);
+	/* the daemon creates the menu window before a client shows up */
+	if (!win)
+		createwin();
+	XMoveResizeWindow(dc->dpy, win, mx, my, mw, mh);
+	XSetWindowBackground(dc->dpy, win, normcol->BG);
 	XClassHint hint = { .res_name = name, .res_class = class };
 	XSetClassHint(dc->dpy, win, &hint);
 
@@ -1229,26 +1349,88 @@ setup(void) {
 											XA_CARDINAL, 32, PropModeReplace,
 											(unsigned char *) &opacity_set, 1L);
 
-	/* open input methods */
-	xim = XOpenIM(dc->dpy, NULL, NULL, NULL);
-	xic = XCreateIC(xim, XNInputStyle, XIMPreeditNothing | XIMStatusNothing,
-					XNClientWindow, win, XNFocusWindow, win, NULL);
-
 	XMapRaised(dc->dpy, win);
 	resizedc(dc, mw, mh);
+	timing("setup");
 	drawmenu();
+	XFlush(dc->dpy);
+	timing("draw");
+}
+
+void
+shrinkmenu(void) {
+	Window root;
+	int x, y, h;
+	unsigned int du;
+
+	/* a streamed menu only learns at end-of-file how few lines it has,
+	 * shrink it like measureinput() would have, keeping the anchored edge */
+	if (menu_height || lines <= nitems)
+		return;
+	lines = nitems;
+	h = (lines + 1) * bh;
+	XGetGeometry(dc->dpy, win, &root, &x, &y, &du, &du, &du, &du);
+	if (centery)
+		y += (mh - h) / 2;
+	else if (!topbar)
+		y += mh - h;
+	mh = h;
+	pagesize = (lines > 0) ? lines : mw / MAX(dc->font.height, 1) + 1;
+	XMoveResizeWindow(dc->dpy, win, x, y, mw, mh);
+	resizedc(dc, mw, mh);
+	calcoffsets();
+}
+
+void
+standby(void) {
+	/* everything a menu needs before it knows its items */
+	warmup();
+	createwin();
+	XSync(dc->dpy, False);
+}
+
+void
+timing(const char *name) {
+	struct timespec now;
+
+	/* one line per phase: name, then start and end in monotonic ns */
+	if (!timings)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	fprintf(stderr, "timing %s %lld %lld\n", name,
+	        (long long)phase.tv_sec * 1000000000 + phase.tv_nsec,
+	        (long long)now.tv_sec * 1000000000 + now.tv_nsec);
+	phase = now;
 }
 
 void
 usage(void) {
 	fputs("usage:\n"
-		"dmenu [-b] [-f] [-i] [-q] [-r] [-n] [-z|-t] [-M] [-Q] [-N]\n"
+		"dmenu [-b] [-f] [-i] [-q] [-r] [-n] [-z|-t] [-M] [-Q] [-N] [-s] [--timings]\n"
+		"      [--trigrams]\n"
 		"      [-V|-H] [-c|--centerx|--centery]\n"
 		"      [-l LINES] [-p PROMPT] [-fn FONT] [-nb COLOR] [-nf COLOR]\n"
 		"      [-sb COLOR] [-sf COLOR] [-x OFFSET] [-y OFFSET] [-w WIDTH]\n"
 		"      [-h HEIGHT] [-lh LINEHEIGHT] [-m (WINDOW|SCREEN)]\n"
 		"      [--name NAME] [--class CLASS] [-o OPACITY] [-d OPACITY]\n"
-		"      [-dc COLOR] [-so LINES] [-v]\n",
+		"      [-dc COLOR] [-so LINES] [--daemon SOCKET]\n"
+		"      [--index FILE] [--mkindex FILE] [--history FILE] [-v]\n",
 		stderr);
 	exit(EXIT_FAILURE);
 }
+
+void
+warmup(void) {
+	initsearch();
+	timing("init");
+	dc = initdc();
+	timing("display");
+	read_resourses();
+	timing("resources");
+	initfont(dc, font ? font : DEFFONT);
+	timing("font");
+	normcol = initcolor(dc, normfgcolor, normbgcolor);
+	selcol = initcolor(dc, selfgcolor, selbgcolor);
+	dimcol = initcolor(dc, dimcolor, dimcolor);
+	timing("colors");
+}
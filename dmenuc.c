@@ -0,0 +1,57 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "server.h"
+#include "util.h"
+
+static void usage(void);
+
+void
+usage(void) {
+	fputs("usage: dmenuc SOCKET [dmenu options]\n", stderr);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[]) {
+	static char buf[1 << 16];
+	int fds[MAXFDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+	struct sockaddr_un sa;
+	unsigned char status;
+	size_t len = 0, n;
+	int i, sock;
+
+	if (argc < 2)
+		usage();
+	memset(&sa, 0, sizeof sa);
+	sa.sun_family = AF_UNIX;
+	if (strlen(argv[1]) >= sizeof sa.sun_path)
+		eprintf("socket path too long: %s\n", argv[1]);
+	strcpy(sa.sun_path, argv[1]);
+	if ((sock = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0
+	|| connect(sock, (struct sockaddr *)&sa, sizeof sa) < 0) {
+		/* no daemon: be an ordinary dmenu */
+		argv[1] = "dmenu";
+		execvp(argv[1], &argv[1]);
+		eprintf("cannot run dmenu:");
+	}
+
+	/* the menu reads our stdin and writes our stdout itself */
+	argv[1] = "dmenu";
+	for (i = 1; i < argc; i++) {
+		if ((n = strlen(argv[i]) + 1) > sizeof buf - len)
+			eprintf("arguments too long\n");
+		memcpy(&buf[len], argv[i], n);
+		len += n;
+	}
+	if (sendfds(sock, buf, len, fds, MAXFDS) < 0)
+		eprintf("cannot send request:");
+	/* the daemon answers with the menu's exit status */
+	if (read(sock, &status, 1) != 1)
+		return EXIT_FAILURE;
+	return status;
+}
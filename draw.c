@@ -1,36 +1,182 @@
 /* See LICENSE file for copyright and license details. */
 #include <locale.h>
-#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <X11/Xlib.h>
+#ifdef SHM
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#endif
 #include "draw.h"
+#include "util.h"
 
 #define MAX(a, b)  ((a) > (b) ? (a) : (b))
 #define MIN(a, b)  ((a) < (b) ? (a) : (b))
+#define NGLYPHS    256 /* ASCII and Latin-1 live in a dense table */
+#define LENGTH(x)  (sizeof (x) / sizeof *(x))
+#define SHMSHARE   4         /* canvases under this share of the screen are drawn on the server */
+#define ROWCACHE   64        /* rendered rows kept for page flips */
+
+static Metric *findglyph(DC *dc, unsigned int rune);
+static void flushdc(DC *dc);
+static void freerows(DC *dc);
+static void *growbatch(void *p, int *cap, int n, size_t size);
+static Bool overlaps(const XRectangle *r, int x, int y, unsigned int w, unsigned int h);
+static void queuecell(DC *dc);
+static void queuerect(DC *dc, int x, int y, unsigned int w, unsigned int h, Bool fill, unsigned long color);
+static void queuerow(RowCopy **q, int *n, int *cap, int slot, DC *dc);
+static void initglyphs(DC *dc);
+static void measureglyph(DC *dc, Metric *g, unsigned int rune);
+#ifdef SHM
+static Sprite *findsprite(DC *dc, unsigned int rune);
+static void fillimage(DC *dc, int x, int y, int w, int h, unsigned long color);
+static void freeshm(DC *dc);
+static void imagetext(DC *dc, int x, int y, const char *text, size_t n, unsigned long color);
+static Bool initshm(DC *dc, unsigned int w, unsigned int h);
+static int loadflags(DC *dc);
+static void rendersprite(DC *dc, Sprite *s, unsigned int rune);
+static int shmerror(Display *dpy, XErrorEvent *ee);
+
+static Bool shmfailed;
+#endif
+static int textadvance(DC *dc, const char *text, size_t len);
+static size_t textfit(DC *dc, const char *text, size_t len, int w);
+static size_t utf8floor(const char *s, size_t i);
+static size_t utf8decode(const char *s, size_t n, unsigned int *rune);
+
+void
+damagedc(DC *dc, int x, int y, unsigned int w, unsigned int h) {
+	XRectangle *r;
+	int i, x2, y2;
+
+	/* drop what the new area covers, skip it if it is already covered */
+	for(i = 0; i < dc->ndamage; i++) {
+		r = &dc->damage[i];
+		if(x >= r->x && y >= r->y && x + (int)w <= r->x + r->width && y + (int)h <= r->y + r->height)
+			return;
+		if(r->x >= x && r->y >= y && r->x + r->width <= x + (int)w && r->y + r->height <= y + (int)h)
+			dc->damage[i--] = dc->damage[--dc->ndamage];
+	}
+	if(dc->ndamage < (int)LENGTH(dc->damage)) {
+		r = &dc->damage[dc->ndamage++];
+		r->x = x;
+		r->y = y;
+		r->width = w;
+		r->height = h;
+		return;
+	}
+	/* too many pieces: damage their bounding box instead */
+	x2 = x + w;
+	y2 = y + h;
+	for(i = 0; i < dc->ndamage; i++) {
+		r = &dc->damage[i];
+		x2 = MAX(x2, r->x + r->width);
+		y2 = MAX(y2, r->y + r->height);
+		x = MIN(x, r->x);
+		y = MIN(y, r->y);
+	}
+	dc->ndamage = 0;
+	damagedc(dc, x, y, x2 - x, y2 - y);
+}
+
+void
+drawcached(DC *dc, const char *text, ColorSet *col) {
+	RowCache *c = &dc->rowcache;
+	Row *r, *victim;
+	int i, j;
+
+	/* text is the key and must not change while cached; rows drawn on
+	 * the client, or that do not fit the atlas, are drawn as usual */
+	if(
+#ifdef SHM
+	   dc->image ||
+#endif
+	   dc->w > c->w || dc->w < dc->font.height || (c->h && dc->h != c->h)
+	|| ROWCACHE * dc->h > 0x7fff) {
+		drawtext(dc, text, col);
+		return;
+	}
+	if(!c->rows && !(c->rows = calloc(ROWCACHE, sizeof *c->rows)))
+		eprintf("cannot malloc %u bytes:", ROWCACHE * sizeof *c->rows);
+	if(!c->atlas) {
+		c->h = dc->h;
+		c->atlas = XCreatePixmap(dc->dpy, DefaultRootWindow(dc->dpy), c->w, ROWCACHE * c->h,
+		                         DefaultDepth(dc->dpy, DefaultScreen(dc->dpy)));
+	}
+	if(c->serial != dc->font.serial) {
+		for(i = 0; i < ROWCACHE; i++)
+			c->rows[i].text = NULL;
+		c->serial = dc->font.serial;
+	}
+	/* text painted under the row would end up on top of it */
+	for(j = 0; j < dc->batch.ncells; j++)
+		if(overlaps(&dc->batch.cells[j], dc->x, dc->y, dc->w, dc->h)) {
+			flushdc(dc);
+			break;
+		}
+	c->tick++;
+	for(i = 0, victim = c->rows; i < ROWCACHE; i++) {
+		r = &c->rows[i];
+		if(r->text == text && r->col == col && r->w == dc->w) {
+			r->used = c->tick;
+			damagedc(dc, dc->x, dc->y, dc->w, dc->h);
+			queuerow(&dc->batch.copies, &dc->batch.ncopies, &dc->batch.copycap, i, dc);
+			queuecell(dc);
+			return;
+		}
+		if(r->used < victim->used)
+			victim = r;
+	}
+	/* miss: draw it as usual and keep a copy of it once painted */
+	drawtext(dc, text, col);
+	victim->text = text;
+	victim->col = col;
+	victim->w = dc->w;
+	victim->used = c->tick;
+	queuerow(&dc->batch.captures, &dc->batch.ncaptures, &dc->batch.capturecap, victim - c->rows, dc);
+	queuecell(dc);
+}
 
 void
 drawrect(DC *dc, int x, int y, unsigned int w, unsigned int h, Bool fill, unsigned long color) {
-	XSetForeground(dc->dpy, dc->gc, color);
-	if(fill)
-		XFillRectangle(dc->dpy, dc->canvas, dc->gc, dc->x + x, dc->y + y, w, h);
-	else
-		XDrawRectangle(dc->dpy, dc->canvas, dc->gc, dc->x + x, dc->y + y, w-1, h-1);
+	damagedc(dc, dc->x + x, dc->y + y, w, h);
+#ifdef SHM
+	if(dc->image) {
+		x += dc->x;
+		y += dc->y;
+		if(fill)
+			fillimage(dc, x, y, w, h, color);
+		else {
+			fillimage(dc, x, y, w, 1, color);
+			fillimage(dc, x, y + h - 1, w, 1, color);
+			fillimage(dc, x, y, 1, h, color);
+			fillimage(dc, x + w - 1, y, 1, h, color);
+		}
+		return;
+	}
+#endif
+	queuerect(dc, dc->x + x, dc->y + y, w, h, fill, color);
 }
 
 void
 drawtext(DC *dc, const char *text, ColorSet *col) {
 	char buf[BUFSIZ];
-	size_t mn, n = strlen(text);
+	size_t i, e, mn, n = strlen(text);
 
 	/* shorten text if necessary */
-	for(mn = MIN(n, sizeof buf); textnw(dc, text, mn) + dc->font.height/2 > dc->w; mn--)
-		if(mn == 0)
-			return;
+	mn = textfit(dc, text, MIN(n, sizeof buf), dc->w - dc->font.height/2);
+	if(mn == 0 && (n > 0 || dc->font.height/2 > dc->w))
+		return;
 	memcpy(buf, text, mn);
-	if(mn < n)
-		for(n = MAX(mn-3, 0); n < mn; buf[n++] = '.');
+	if(mn < n) {
+		/* replace up to three whole runes with dots */
+		for(i = 0, e = mn; i < 3 && e > 0; i++)
+			e = utf8floor(text, e - 1);
+		memset(&buf[e], '.', i);
+		mn = e + i;
+	}
 
 	drawrect(dc, 0, 0, dc->w, dc->h, True, col->BG);
 	drawtextn(dc, buf, mn, col);
@@ -40,14 +186,56 @@ void
 drawtextn(DC *dc, const char *text, size_t n, ColorSet *col) {
 	int x = dc->x + dc->font.height/2;
 	int y = dc->y + dc->font.ascent + (dc->h - dc->font.height)/2;
+	GlyphBatch *b;
+	Metric *g;
+	unsigned int rune;
+	size_t i, len;
+	int j;
 
-	XSetForeground(dc->dpy, dc->gc, col->FG);
+#ifdef SHM
+	if(dc->image) {
+		imagetext(dc, x, y, text, n, col->FG);
+		return;
+	}
+#endif
 	if(dc->font.xft_font) {
 		if (!dc->xftdraw)
 			eprintf("error, xft drawable does not exist");
-		XftDrawStringUtf8(dc->xftdraw, &col->FG_xft,
-			dc->font.xft_font, x, y, (unsigned char*)text, n);
-	} else if(dc->font.set) {
+		/* queue positioned glyphs by colour, mapdc() sends them; text
+		 * over queued text would lose its order, send that first */
+		for(j = 0; j < dc->batch.ncells; j++)
+			if(overlaps(&dc->batch.cells[j], dc->x, dc->y, dc->w, dc->h)) {
+				flushdc(dc);
+				break;
+			}
+		for(j = 0; j < dc->batch.nglyphs; j++)
+			if(dc->batch.glyphs[j].color->pixel == col->FG_xft.pixel)
+				break;
+		if(j == dc->batch.nglyphs) {
+			dc->batch.glyphs = growbatch(dc->batch.glyphs, &dc->batch.glyphcap, j + 1, sizeof *dc->batch.glyphs);
+			b = &dc->batch.glyphs[dc->batch.nglyphs++];
+			b->color = &col->FG_xft;
+			b->n = 0;
+		}
+		b = &dc->batch.glyphs[j];
+		b->specs = growbatch(b->specs, &b->cap, b->n + n, sizeof *b->specs);
+		/* the pen advances by the cached metrics, as Xft would; like
+		 * XftDrawStringUtf8() stop at invalid UTF-8 */
+		for(i = 0; i < n && (len = utf8decode(&text[i], n - i, &rune)); i += len) {
+			g = findglyph(dc, rune);
+			b->specs[b->n].font = dc->font.xft_font;
+			b->specs[b->n].glyph = g->glyph;
+			b->specs[b->n].x = x;
+			b->specs[b->n++].y = y;
+			x += g->xoff;
+		}
+		queuecell(dc);
+		return;
+	}
+	/* core text is not batched, paint what is under it first */
+	flushdc(dc);
+	XSetForeground(dc->dpy, dc->gc, col->FG);
+	if(dc->font.set) {
 		XmbDrawString(dc->dpy, dc->canvas, dc->font.set, dc->gc, x, y, text, n);
 	} else {
 		XSetFont(dc->dpy, dc->gc, dc->font.xfont->fid);
@@ -55,19 +243,130 @@ drawtextn(DC *dc, const char *text, size_t n, ColorSet *col) {
 	}
 }
 
+Metric *
+findglyph(DC *dc, unsigned int rune) {
+	Metric *old;
+	size_t i, j, mask;
+
+	if(rune < NGLYPHS) {
+		if(dc->font.glyphs[rune].rune != rune)
+			measureglyph(dc, &dc->font.glyphs[rune], rune);
+		return &dc->font.glyphs[rune];
+	}
+	/* keep the hash at most half full */
+	if(2 * (dc->font.hashcount + 1) > dc->font.hashsize) {
+		old = dc->font.hash;
+		j = dc->font.hashsize;
+		dc->font.hashsize = j ? 2 * j : 256;
+		if(!(dc->font.hash = calloc(dc->font.hashsize, sizeof *dc->font.hash)))
+			eprintf("cannot malloc %u bytes:", dc->font.hashsize * sizeof *dc->font.hash);
+		mask = dc->font.hashsize - 1;
+		while(j--)
+			if(old[j].rune) {
+				for(i = (old[j].rune * 2654435761u) & mask; dc->font.hash[i].rune; i = (i + 1) & mask);
+				dc->font.hash[i] = old[j];
+			}
+		free(old);
+	}
+	mask = dc->font.hashsize - 1;
+	for(i = (rune * 2654435761u) & mask; dc->font.hash[i].rune; i = (i + 1) & mask)
+		if(dc->font.hash[i].rune == rune)
+			return &dc->font.hash[i];
+	/* first time this rune is seen: measure it once */
+	measureglyph(dc, &dc->font.hash[i], rune);
+	dc->font.hashcount++;
+	return &dc->font.hash[i];
+}
+
+#ifdef SHM
+Sprite *
+findsprite(DC *dc, unsigned int rune) {
+	Sprite *old;
+	size_t i, j, mask;
+
+	/* the same open addressing as the metric hash */
+	if(2 * (dc->font.spritecount + 1) > dc->font.spritesize) {
+		old = dc->font.sprites;
+		j = dc->font.spritesize;
+		dc->font.spritesize = j ? 2 * j : 256;
+		if(!(dc->font.sprites = calloc(dc->font.spritesize, sizeof *dc->font.sprites)))
+			eprintf("cannot malloc %u bytes:", dc->font.spritesize * sizeof *dc->font.sprites);
+		mask = dc->font.spritesize - 1;
+		while(j--)
+			if(old[j].rune) {
+				for(i = (old[j].rune * 2654435761u) & mask; dc->font.sprites[i].rune; i = (i + 1) & mask);
+				dc->font.sprites[i] = old[j];
+			}
+		free(old);
+	}
+	mask = dc->font.spritesize - 1;
+	for(i = (rune * 2654435761u) & mask; dc->font.sprites[i].rune; i = (i + 1) & mask)
+		if(dc->font.sprites[i].rune == rune)
+			return &dc->font.sprites[i];
+	rendersprite(dc, &dc->font.sprites[i], rune);
+	dc->font.spritecount++;
+	return &dc->font.sprites[i];
+}
+
 void
-eprintf(const char *fmt, ...) {
-	va_list ap;
+fillimage(DC *dc, int x, int y, int w, int h, unsigned long color) {
+	uint32_t *row;
+	int i, j;
+
+	if(x < 0) {
+		w += x;
+		x = 0;
+	}
+	if(y < 0) {
+		h += y;
+		y = 0;
+	}
+	w = MIN(w, dc->image->width - x);
+	h = MIN(h, dc->image->height - y);
+	if(w <= 0 || h <= 0)
+		return;
+	/* fill the first row, copy it down */
+	row = (uint32_t *)(dc->image->data + y * dc->image->bytes_per_line) + x;
+	for(i = 0; i < w; i++)
+		row[i] = color;
+	for(j = 1; j < h; j++)
+		memcpy((char *)row + j * dc->image->bytes_per_line, row, w * sizeof *row);
+}
+#endif
 
-	va_start(ap, fmt);
-	vfprintf(stderr, fmt, ap);
-	va_end(ap);
+void
+flushdc(DC *dc) {
+	RectBatch *r;
+	GlyphBatch *g;
+	RowCopy *c;
+	int i;
 
-	if(fmt[0] != '\0' && fmt[strlen(fmt)-1] == ':') {
-		fputc(' ', stderr);
-		perror(NULL);
+	/* a few requests per frame: rectangles by colour, cached rows, then
+	 * text by colour */
+	for(i = 0; i < dc->batch.nrects; i++) {
+		r = &dc->batch.rects[i];
+		XSetForeground(dc->dpy, dc->gc, r->color);
+		if(r->fill)
+			XFillRectangles(dc->dpy, dc->canvas, dc->gc, r->rects, r->n);
+		else
+			XDrawRectangles(dc->dpy, dc->canvas, dc->gc, r->rects, r->n);
+	}
+	for(i = 0; i < dc->batch.ncopies; i++) {
+		c = &dc->batch.copies[i];
+		XCopyArea(dc->dpy, dc->rowcache.atlas, dc->canvas, dc->gc,
+		          0, c->slot * dc->rowcache.h, c->w, c->h, c->x, c->y);
+	}
+	for(i = 0; i < dc->batch.nglyphs; i++) {
+		g = &dc->batch.glyphs[i];
+		XftDrawGlyphFontSpec(dc->xftdraw, g->color, g->specs, g->n);
+	}
+	for(i = 0; i < dc->batch.ncaptures; i++) {
+		c = &dc->batch.captures[i];
+		XCopyArea(dc->dpy, dc->canvas, dc->rowcache.atlas, dc->gc,
+		          c->x, c->y, c->w, c->h, 0, c->slot * dc->rowcache.h);
 	}
-	exit(EXIT_FAILURE);
+	dc->batch.nrects = dc->batch.nglyphs = dc->batch.ncells = 0;
+	dc->batch.ncopies = dc->batch.ncaptures = 0;
 }
 
 void
@@ -82,14 +381,34 @@ freecol(DC *dc, ColorSet *col) {
 
 void
 freedc(DC *dc) {
+#ifdef SHM
+	freeshm(dc);
+#endif
     if(dc->font.xft_font) {
         XftFontClose(dc->dpy, dc->font.xft_font);
-        XftDrawDestroy(dc->xftdraw);
+        if(dc->xftdraw)
+            XftDrawDestroy(dc->xftdraw);
     }
 	if(dc->font.set)
 		XFreeFontSet(dc->dpy, dc->font.set);
     if(dc->font.xfont)
 		XFreeFont(dc->dpy, dc->font.xfont);
+	free(dc->font.glyphs);
+	free(dc->font.hash);
+	while(dc->font.spritesize)
+		free(dc->font.sprites[--dc->font.spritesize].alpha);
+	free(dc->font.sprites);
+	while(dc->batch.rectcap)
+		free(dc->batch.rects[--dc->batch.rectcap].rects);
+	while(dc->batch.glyphcap)
+		free(dc->batch.glyphs[--dc->batch.glyphcap].specs);
+	free(dc->batch.rects);
+	free(dc->batch.glyphs);
+	free(dc->batch.cells);
+	free(dc->batch.copies);
+	free(dc->batch.captures);
+	freerows(dc);
+	free(dc->rowcache.rows);
     if(dc->canvas)
 		XFreePixmap(dc->dpy, dc->canvas);
 	if(dc->gc)
@@ -146,6 +465,18 @@ initfont(DC *dc, const char *fontstr) {
 	int i, n;
 	XFontStruct **xfonts;
 
+	/* a resident menu may be asked for another font */
+	if(dc->font.xft_font)
+		XftFontClose(dc->dpy, dc->font.xft_font);
+	if(dc->font.set)
+		XFreeFontSet(dc->dpy, dc->font.set);
+	if(dc->font.xfont)
+		XFreeFont(dc->dpy, dc->font.xfont);
+	dc->font.xft_font = NULL;
+	dc->font.set = NULL;
+	dc->font.xfont = NULL;
+	dc->font.ascent = dc->font.descent = dc->font.width = 0;
+
 	missing = NULL;
 	if((dc->font.xfont = XLoadQueryFont(dc->dpy, fontstr))) {
 		dc->font.ascent = dc->font.xfont->ascent;
@@ -168,12 +499,279 @@ initfont(DC *dc, const char *fontstr) {
 	if(missing)
 		XFreeStringList(missing);
 	dc->font.height = dc->font.ascent + dc->font.descent;
+	dc->font.serial++;
+	initglyphs(dc);
 	return;
 }
 
+#ifdef SHM
+void
+freeshm(DC *dc) {
+	if(!dc->image)
+		return;
+	XShmDetach(dc->dpy, &dc->shm);
+	XSync(dc->dpy, False);
+	shmdt(dc->shm.shmaddr);
+	dc->image->data = NULL;
+	XDestroyImage(dc->image);
+	dc->image = NULL;
+}
+
+void
+imagetext(DC *dc, int x, int y, const char *text, size_t n, unsigned long color) {
+	Sprite *s;
+	unsigned int rune, a, fg, bg;
+	uint32_t *p;
+	size_t i, len;
+	int gx, gy, j, k;
+
+	/* pen positions come from the same metrics textnw() sums; like the
+	 * xft path, stop at invalid UTF-8 */
+	for(i = 0; i < n && (len = utf8decode(&text[i], n - i, &rune)); i += len, x += findglyph(dc, rune)->xoff) {
+		s = findsprite(dc, rune);
+		for(j = 0; j < s->h; j++) {
+			gy = y - s->top + j;
+			if(gy < 0 || gy >= dc->image->height)
+				continue;
+			p = (uint32_t *)(dc->image->data + gy * dc->image->bytes_per_line);
+			for(k = 0; k < s->w; k++) {
+				gx = x + s->left + k;
+				if(gx < 0 || gx >= dc->image->width || !(a = s->alpha[j * s->w + k]))
+					continue;
+				if(a == 0xff) {
+					p[gx] = color;
+					continue;
+				}
+				/* blend each 8-bit channel of the TrueColor pixel */
+				bg = p[gx];
+				fg = ((color & 0xff) * a + (bg & 0xff) * (0xff - a)) / 0xff;
+				fg |= (((color >> 8) & 0xff) * a + ((bg >> 8) & 0xff) * (0xff - a)) / 0xff << 8;
+				fg |= (((color >> 16) & 0xff) * a + ((bg >> 16) & 0xff) * (0xff - a)) / 0xff << 16;
+				p[gx] = fg;
+			}
+		}
+	}
+}
+#endif
+
+void
+freerows(DC *dc) {
+	int i;
+
+	if(dc->rowcache.atlas)
+		XFreePixmap(dc->dpy, dc->rowcache.atlas);
+	dc->rowcache.atlas = None;
+	dc->rowcache.h = 0;
+	if(dc->rowcache.rows)
+		for(i = 0; i < ROWCACHE; i++)
+			dc->rowcache.rows[i].text = NULL;
+}
+
+void *
+growbatch(void *p, int *cap, int n, size_t size) {
+	int old = *cap;
+
+	if(n <= old)
+		return p;
+	*cap = MAX(n, 2 * old);
+	if(!(p = realloc(p, *cap * size)))
+		eprintf("cannot realloc %u bytes:", *cap * size);
+	/* new slots own no buffers yet */
+	memset((char *)p + old * size, 0, (*cap - old) * size);
+	return p;
+}
+
+void
+initglyphs(DC *dc) {
+	unsigned int i;
+
+	free(dc->font.glyphs);
+	free(dc->font.hash);
+	dc->font.glyphs = dc->font.hash = NULL;
+	dc->font.hashsize = dc->font.hashcount = 0;
+	while(dc->font.spritesize)
+		free(dc->font.sprites[--dc->font.spritesize].alpha);
+	free(dc->font.sprites);
+	dc->font.sprites = NULL;
+	dc->font.spritecount = 0;
+	/* font sets convert through the locale, leave them to Xlib */
+	if(!dc->font.xft_font && !dc->font.xfont)
+		return;
+	if(!(dc->font.glyphs = calloc(NGLYPHS, sizeof *dc->font.glyphs)))
+		eprintf("cannot malloc %u bytes:", NGLYPHS * sizeof *dc->font.glyphs);
+	/* ASCII is needed by almost any menu, the rest is measured on sight */
+	for(i = 0; i < 0x80; i++)
+		measureglyph(dc, &dc->font.glyphs[i], i);
+}
+
+#ifdef SHM
+Bool
+initshm(DC *dc, unsigned int w, unsigned int h) {
+	int screen = DefaultScreen(dc->dpy), rgba = FC_RGBA_NONE;
+	Visual *vis = DefaultVisual(dc->dpy, screen);
+	XErrorHandler handler;
+
+	/* rasterize on the client only for full-screen canvases, where it
+	 * pays off, and only where pixels are plain RGB and glyphs need no
+	 * subpixel filtering, so both paths render the same */
+	if(!dc->font.xft_font || (unsigned long)w * h * SHMSHARE
+	   < (unsigned long)DisplayWidth(dc->dpy, screen) * DisplayHeight(dc->dpy, screen)
+	|| !XShmQueryExtension(dc->dpy)
+	|| vis->class != TrueColor || vis->red_mask != 0xff0000 || vis->green_mask != 0xff00 || vis->blue_mask != 0xff)
+		return False;
+	FcPatternGetInteger(dc->font.xft_font->pattern, FC_RGBA, 0, &rgba);
+	if(rgba != FC_RGBA_NONE && rgba != FC_RGBA_UNKNOWN && !(loadflags(dc) & FT_LOAD_MONOCHROME))
+		return False;
+	if(!(dc->image = XShmCreateImage(dc->dpy, vis, DefaultDepth(dc->dpy, screen), ZPixmap, NULL, &dc->shm, w, h)))
+		return False;
+	if(dc->image->bits_per_pixel != 32
+	|| (dc->shm.shmid = shmget(IPC_PRIVATE, dc->image->bytes_per_line * h, IPC_CREAT | 0600)) < 0) {
+		XDestroyImage(dc->image);
+		dc->image = NULL;
+		return False;
+	}
+	dc->shm.shmaddr = dc->image->data = shmat(dc->shm.shmid, NULL, 0);
+	dc->shm.readOnly = False;
+	/* a remote server fails the attach asynchronously, catch that */
+	shmfailed = (dc->shm.shmaddr == (char *)-1);
+	if(!shmfailed) {
+		handler = XSetErrorHandler(shmerror);
+		XShmAttach(dc->dpy, &dc->shm);
+		XSync(dc->dpy, False);
+		XSetErrorHandler(handler);
+		if(shmfailed)
+			shmdt(dc->shm.shmaddr);
+	}
+	shmctl(dc->shm.shmid, IPC_RMID, NULL);
+	if(shmfailed) {
+		dc->image->data = NULL;
+		XDestroyImage(dc->image);
+		dc->image = NULL;
+		return False;
+	}
+	return True;
+}
+#endif
+
+void
+measureglyph(DC *dc, Metric *g, unsigned int rune) {
+	XGlyphInfo gi;
+	FT_UInt glyph;
+	char c;
+
+	g->rune = rune;
+	if(dc->font.xft_font) {
+		g->glyph = glyph = XftCharIndex(dc->dpy, dc->font.xft_font, rune);
+		XftGlyphExtents(dc->dpy, dc->font.xft_font, &glyph, 1, &gi);
+		g->x = gi.x;
+		g->width = gi.width;
+		g->xoff = gi.xOff;
+	} else {
+		/* core fonts are measured byte by byte and have no ink offsets */
+		c = (char)rune;
+		g->x = 0;
+		g->width = g->xoff = XTextWidth(dc->font.xfont, &c, 1);
+	}
+}
+
 void
 mapdc(DC *dc, Window win, unsigned int w, unsigned int h) {
-	XCopyArea(dc->dpy, dc->canvas, win, dc->gc, 0, 0, w, h, 0, 0);
+	XRectangle *r;
+	int i, x, y;
+
+	flushdc(dc);
+	/* copy only what was drawn or exposed since the last call */
+	for(i = 0; i < dc->ndamage; i++) {
+		r = &dc->damage[i];
+		x = MAX(r->x, 0);
+		y = MAX(r->y, 0);
+		if(x >= (int)w || y >= (int)h)
+			continue;
+#ifdef SHM
+		if(dc->image) {
+			XShmPutImage(dc->dpy, win, dc->gc, dc->image, x, y, x, y,
+			             MIN(r->x + r->width, (int)w) - x, MIN(r->y + r->height, (int)h) - y, False);
+			continue;
+		}
+#endif
+		XCopyArea(dc->dpy, dc->canvas, win, dc->gc, x, y,
+		          MIN(r->x + r->width, (int)w) - x, MIN(r->y + r->height, (int)h) - y, x, y);
+	}
+#ifdef SHM
+	/* the server reads the segment asynchronously: let it finish before
+	 * the next frame draws over it */
+	if(dc->image && dc->ndamage)
+		XSync(dc->dpy, False);
+#endif
+	dc->ndamage = 0;
+}
+
+Bool
+overlaps(const XRectangle *r, int x, int y, unsigned int w, unsigned int h) {
+	return x < r->x + r->width && r->x < x + (int)w && y < r->y + r->height && r->y < y + (int)h;
+}
+
+void
+queuecell(DC *dc) {
+	XRectangle *r;
+
+	dc->batch.cells = growbatch(dc->batch.cells, &dc->batch.cellcap, dc->batch.ncells + 1, sizeof *dc->batch.cells);
+	r = &dc->batch.cells[dc->batch.ncells++];
+	r->x = dc->x;
+	r->y = dc->y;
+	r->width = dc->w;
+	r->height = dc->h;
+}
+
+void
+queuerect(DC *dc, int x, int y, unsigned int w, unsigned int h, Bool fill, unsigned long color) {
+	RectBatch *b;
+	XRectangle *r;
+	Bool under = False;
+	int i, j, k;
+
+	for(i = 0; i < dc->batch.nrects; i++)
+		if(dc->batch.rects[i].color == color && dc->batch.rects[i].fill == fill)
+			break;
+	/* joining its colour's batch must not paint it under anything queued
+	 * after that batch, text included; send the frame so far if it would */
+	for(j = 0; !under && j < dc->batch.ncells; j++)
+		under = overlaps(&dc->batch.cells[j], x, y, w, h);
+	for(k = i + 1; !under && k < dc->batch.nrects; k++)
+		for(j = 0; !under && j < dc->batch.rects[k].n; j++)
+			under = overlaps(&dc->batch.rects[k].rects[j], x, y, w, h);
+	if(under) {
+		flushdc(dc);
+		i = 0;
+	}
+	if(i == dc->batch.nrects) {
+		dc->batch.rects = growbatch(dc->batch.rects, &dc->batch.rectcap, i + 1, sizeof *dc->batch.rects);
+		b = &dc->batch.rects[dc->batch.nrects++];
+		b->color = color;
+		b->fill = fill;
+		b->n = 0;
+	}
+	b = &dc->batch.rects[i];
+	b->rects = growbatch(b->rects, &b->cap, b->n + 1, sizeof *b->rects);
+	r = &b->rects[b->n++];
+	r->x = x;
+	r->y = y;
+	/* outlines are drawn like XDrawRectangle(), one pixel inside */
+	r->width = fill ? w : w - 1;
+	r->height = fill ? h : h - 1;
+}
+
+void
+queuerow(RowCopy **q, int *n, int *cap, int slot, DC *dc) {
+	RowCopy *c;
+
+	*q = growbatch(*q, cap, *n + 1, sizeof **q);
+	c = &(*q)[(*n)++];
+	c->slot = slot;
+	c->x = dc->x;
+	c->y = dc->y;
+	c->w = dc->w;
+	c->h = dc->h;
 }
 
 void
@@ -181,20 +779,173 @@ resizedc(DC *dc, unsigned int w, unsigned int h) {
 	int screen = DefaultScreen(dc->dpy);
 	if(dc->canvas)
 		XFreePixmap(dc->dpy, dc->canvas);
+	dc->canvas = None;
 
 	dc->w = w;
 	dc->h = h;
+	dc->ndamage = 0;
+	dc->batch.nrects = dc->batch.nglyphs = dc->batch.ncells = 0;
+	dc->batch.ncopies = dc->batch.ncaptures = 0;
+	freerows(dc);
+	dc->rowcache.w = w;
+#ifdef SHM
+	freeshm(dc);
+	if(initshm(dc, w, h))
+		return;
+#endif
 	dc->canvas = XCreatePixmap(dc->dpy, DefaultRootWindow(dc->dpy), w, h,
 	                           DefaultDepth(dc->dpy, screen));
-	if(dc->font.xft_font && !(dc->xftdraw)) {
+	/* a resize replaces the canvas: point the xft drawable at the new one */
+	if(dc->xftdraw)
+		XftDrawChange(dc->xftdraw, dc->canvas);
+	else if(dc->font.xft_font) {
 		dc->xftdraw = XftDrawCreate(dc->dpy, dc->canvas, DefaultVisual(dc->dpy,screen), DefaultColormap(dc->dpy,screen));
 		if(!(dc->xftdraw))
 			eprintf("error, cannot create xft drawable\n");
 	}
 }
 
+#ifdef SHM
+int
+loadflags(DC *dc) {
+	FcPattern *p = dc->font.xft_font->pattern;
+	FcBool aa = FcTrue, hinting = FcTrue, autohint = FcFalse, bitmap = FcFalse;
+	int style = FC_HINT_FULL, flags = FT_LOAD_RENDER;
+
+	/* load glyphs the way Xft does for this font's pattern */
+	FcPatternGetBool(p, FC_ANTIALIAS, 0, &aa);
+	FcPatternGetBool(p, FC_HINTING, 0, &hinting);
+	FcPatternGetInteger(p, FC_HINT_STYLE, 0, &style);
+	FcPatternGetBool(p, FC_AUTOHINT, 0, &autohint);
+	FcPatternGetBool(p, FC_EMBEDDED_BITMAP, 0, &bitmap);
+	if(!hinting || style == FC_HINT_NONE)
+		flags |= FT_LOAD_NO_HINTING;
+	if(!aa)
+		flags |= FT_LOAD_MONOCHROME | FT_LOAD_TARGET_MONO;
+	else if(style == FC_HINT_SLIGHT)
+		flags |= FT_LOAD_TARGET_LIGHT;
+	if(autohint)
+		flags |= FT_LOAD_FORCE_AUTOHINT;
+	/* antialiased text only uses embedded bitmaps when asked to */
+	if(aa && !bitmap)
+		flags |= FT_LOAD_NO_BITMAP;
+	return flags;
+}
+
+void
+rendersprite(DC *dc, Sprite *s, unsigned int rune) {
+	FT_Face face;
+	FT_Bitmap *b;
+	unsigned char *row;
+	int i, j;
+
+	s->rune = rune;
+	s->left = s->top = s->w = s->h = 0;
+	s->alpha = NULL;
+	if(!(face = XftLockFace(dc->font.xft_font)))
+		return;
+	/* only coverage bitmaps can be blended, colour glyphs stay blank */
+	if(!FT_Load_Glyph(face, XftCharIndex(dc->dpy, dc->font.xft_font, rune), loadflags(dc))
+	&& (b = &face->glyph->bitmap)->width && b->rows && b->pitch > 0
+	&& (b->pixel_mode == FT_PIXEL_MODE_GRAY || b->pixel_mode == FT_PIXEL_MODE_MONO)
+	&& (s->alpha = malloc(b->width * b->rows))) {
+		s->left = face->glyph->bitmap_left;
+		s->top = face->glyph->bitmap_top;
+		s->w = b->width;
+		s->h = b->rows;
+		for(j = 0; j < s->h; j++) {
+			row = b->buffer + j * b->pitch;
+			for(i = 0; i < s->w; i++)
+				s->alpha[j * s->w + i] = (b->pixel_mode == FT_PIXEL_MODE_GRAY) ? row[i]
+				                       : ((row[i >> 3] >> (7 - (i & 7))) & 1) * 0xff;
+		}
+	}
+	XftUnlockFace(dc->font.xft_font);
+}
+#endif
+
+int
+textadvance(DC *dc, const char *text, size_t len) {
+	Metric *g;
+	unsigned int rune;
+	size_t i, n;
+	int pen = 0, left = 0, right = 0;
+
+	if(!dc->font.xft_font) {
+		for(i = 0; i < len; i++)
+			pen += findglyph(dc, (unsigned char)text[i])->xoff;
+		return pen;
+	}
+	/* the same ink box XftGlyphExtents() computes, from cached metrics */
+	for(i = 0; i < len; i += n) {
+		if(!(n = utf8decode(&text[i], len - i, &rune)))
+			return -1;
+		g = findglyph(dc, rune);
+		if(i == 0 || pen - g->x < left)
+			left = pen - g->x;
+		if(i == 0 || pen - g->x + g->width > right)
+			right = pen - g->x + g->width;
+		pen += g->xoff;
+	}
+	return right - left;
+}
+
+size_t
+textfit(DC *dc, const char *text, size_t len, int w) {
+	Metric *g;
+	unsigned int rune;
+	size_t i, n, lo, hi, mid;
+	int pen = 0, left = 0, right = 0;
+
+	/* return the length of the longest prefix at most w wide, cut at a
+	 * rune boundary; walk the cached metrics while they are valid */
+	if(dc->font.glyphs) {
+		for(i = 0; i < len; i += n) {
+			if(!dc->font.xft_font) {
+				n = 1;
+				rune = (unsigned char)text[i];
+			}
+			else if(!(n = utf8decode(&text[i], len - i, &rune)))
+				break;
+			g = findglyph(dc, rune);
+			if(i == 0 || pen - g->x < left)
+				left = pen - g->x;
+			if(i == 0 || pen - g->x + g->width > right)
+				right = pen - g->x + g->width;
+			if(right - left > w)
+				return utf8floor(text, i);
+			pen += g->xoff;
+		}
+		if(i >= len)
+			return len;
+	}
+	/* prefix widths only grow, so binary search the rest */
+	for(lo = 0, hi = len; lo < hi; ) {
+		mid = lo + (hi - lo + 1) / 2;
+		if(textnw(dc, text, utf8floor(text, mid)) <= w)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return utf8floor(text, lo);
+}
+
+#ifdef SHM
+int
+shmerror(Display *dpy, XErrorEvent *ee) {
+	shmfailed = True;
+	return 0;
+}
+#endif
+
 int
 textnw(DC *dc, const char *text, size_t len) {
+	int w;
+
+	/* sum cached glyph metrics; Xft neither kerns nor shapes, so this is
+	 * exact, and only invalid UTF-8 needs asking Xft itself */
+	if(dc->font.glyphs && (w = textadvance(dc, text, len)) >= 0)
+		return w;
 	if(dc->font.xft_font) {
 		XGlyphInfo gi;
 		XftTextExtentsUtf8(dc->dpy, dc->font.xft_font, (const FcChar8*)text, len, &gi);
@@ -211,3 +962,43 @@ int
 textw(DC *dc, const char *text) {
 	return textnw(dc, text, strlen(text)) + dc->font.height;
 }
+
+size_t
+utf8floor(const char *s, size_t i) {
+	/* back i up to the start of the rune it points into */
+	while(i > 0 && (s[i] & 0xc0) == 0x80)
+		i--;
+	return i;
+}
+
+size_t
+utf8decode(const char *s, size_t n, unsigned int *rune) {
+	const unsigned char *u = (const unsigned char *)s;
+	size_t i, len;
+
+	/* return the length of the sequence at s, 0 if it is not valid */
+	if(u[0] < 0x80) {
+		*rune = u[0];
+		return 1;
+	}
+	else if((u[0] & 0xe0) == 0xc0)
+		len = 2, *rune = u[0] & 0x1f;
+	else if((u[0] & 0xf0) == 0xe0)
+		len = 3, *rune = u[0] & 0x0f;
+	else if((u[0] & 0xf8) == 0xf0)
+		len = 4, *rune = u[0] & 0x07;
+	else
+		return 0;
+	if(len > n)
+		return 0;
+	for(i = 1; i < len; i++) {
+		if((u[i] & 0xc0) != 0x80)
+			return 0;
+		*rune = (*rune << 6) | (u[i] & 0x3f);
+	}
+	/* reject overlong forms, surrogates and runes past U+10FFFF */
+	if(*rune < (len == 2 ? 0x80 : len == 3 ? 0x800 : 0x10000)
+	|| (*rune >= 0xd800 && *rune <= 0xdfff) || *rune > 0x10ffff)
+		return 0;
+	return len;
+}
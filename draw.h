@@ -1,6 +1,74 @@
 /* See LICENSE file for copyright and license details. */
 
 #include <X11/Xft/Xft.h>
+#ifdef SHM
+#include <X11/extensions/XShm.h>
+#endif
+
+typedef struct {
+	unsigned int rune;  /* codepoint, 0 marks a free hash slot */
+	unsigned int glyph; /* Xft glyph index */
+	short x, width, xoff;
+} Metric;
+
+typedef struct {
+	unsigned long FG;
+	XftColor FG_xft;
+	unsigned long BG;
+} ColorSet;
+
+typedef struct {
+	const char *text; /* NULL marks a free slot */
+	ColorSet *col;
+	int w;
+	unsigned long used;
+} Row;
+
+typedef struct {
+	Pixmap atlas;     /* rendered rows, stacked h pixels apart */
+	Row *rows;
+	int w, h;
+	unsigned int serial;
+	unsigned long tick;
+} RowCache;
+
+typedef struct {
+	int slot;
+	int x, y;
+	unsigned int w, h;
+} RowCopy;
+
+typedef struct {
+	unsigned long color;
+	Bool fill;
+	XRectangle *rects;
+	int n, cap;
+} RectBatch;
+
+typedef struct {
+	XftColor *color;
+	XftGlyphFontSpec *specs;
+	int n, cap;
+} GlyphBatch;
+
+typedef struct {
+	RectBatch *rects;   /* queued rectangles by colour, in paint order */
+	int nrects, rectcap;
+	GlyphBatch *glyphs; /* queued text by colour, painted over the rectangles */
+	int nglyphs, glyphcap;
+	XRectangle *cells;  /* where queued text and rows go */
+	int ncells, cellcap;
+	RowCopy *copies;    /* cached rows to paint, between rectangles and text */
+	int ncopies, copycap;
+	RowCopy *captures;  /* drawn rows to cache once the frame is painted */
+	int ncaptures, capturecap;
+} Batch;
+
+typedef struct {
+	unsigned int rune;    /* codepoint, 0 marks a free hash slot */
+	short left, top, w, h;
+	unsigned char *alpha; /* w * h coverage rendered by FreeType */
+} Sprite;
 
 typedef struct {
 	int x, y, w, h;
@@ -9,28 +77,37 @@ typedef struct {
 	GC gc;
 	Pixmap canvas;
 	XftDraw *xftdraw;
+	XRectangle damage[8]; /* canvas areas not yet copied to the window */
+	int ndamage;
+	Batch batch; /* server requests of the frame being drawn */
+	RowCache rowcache;
+#ifdef SHM
+	XImage *image;        /* client-side canvas, NULL when drawing on the server */
+	XShmSegmentInfo shm;
+#endif
 	struct {
 		int ascent;
 		int descent;
 		int height;
 		int width;
+		unsigned int serial; /* bumped by each initfont() */
+		Metric *glyphs;      /* metrics of U+0000..U+00FF, NULL for font sets */
+		Metric *hash;        /* metrics of other runes, filled as they are seen */
+		size_t hashsize, hashcount;
+		Sprite *sprites;     /* rendered glyphs of the client-side canvas */
+		size_t spritesize, spritecount;
 		XFontSet set;
 		XFontStruct *xfont;
 		XftFont *xft_font;
 	} font;
 } DC;  /* draw context */
 
-typedef struct {
-	unsigned long FG;
-	XftColor FG_xft;
-	unsigned long BG;
-} ColorSet;
-
+void damagedc(DC *dc, int x, int y, unsigned int w, unsigned int h);
+void drawcached(DC *dc, const char *text, ColorSet *col);
 void drawrect(DC *dc, int x, int y, unsigned int w, unsigned int h, Bool fill, unsigned long color);
 void drawtext(DC *dc, const char *text, ColorSet *col);
 void drawtextn(DC *dc, const char *text, size_t n, ColorSet *col);
 void freecol(DC *dc, ColorSet *col);
-void eprintf(const char *fmt, ...);
 void freedc(DC *dc);
 unsigned long getcolor(DC *dc, const char *colstr);
 ColorSet *initcolor(DC *dc, const char *foreground, const char *background);
@@ -0,0 +1,199 @@
+/* See LICENSE file for copyright and license details. */
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "history.h"
+
+#define HISTORYMAGIC   "dmenuhst"
+#define HISTORYVERSION 1
+#define HISTORYMIN     256 /* slots in a new store, always a power of two */
+#define DAY            (24 * 60 * 60)
+
+typedef struct {
+	char magic[8];
+	uint32_t version, cap, n, pad;
+} Header;
+
+typedef struct {
+	uint64_t hash;  /* of the selected text, 0 marks a free slot */
+	uint32_t count; /* times selected */
+	uint32_t last;  /* last selected, in seconds since the epoch */
+} Slot;
+
+static uint64_t hash(const char *s, size_t len);
+static Slot *lookup(uint64_t h);
+static void mapstore(void);
+
+static const char *storepath = NULL;
+static int storefd = -1;
+static Header *store = NULL; /* the mapped store: header, then cap slots */
+static size_t storesize = 0;
+static time_t now;
+
+int
+frecency(const char *text, size_t len) {
+	Slot *s;
+	time_t age;
+
+	/* selections count more the more recent they are */
+	if (!store || !(s = lookup(hash(text, len)))->hash)
+		return 0;
+	age = now - (time_t)s->last;
+	if (age < DAY / 6)
+		return s->count * 100;
+	if (age < DAY)
+		return s->count * 80;
+	if (age < 7 * DAY)
+		return s->count * 60;
+	if (age < 30 * DAY)
+		return s->count * 40;
+	if (age < 90 * DAY)
+		return s->count * 20;
+	return s->count * 10;
+}
+
+uint64_t
+hash(const char *s, size_t len) {
+	uint64_t h = 14695981039346656037UL;
+
+	/* FNV-1a, never 0 so that marks a free slot */
+	while (len--)
+		h = (h ^ (unsigned char)*s++) * 1099511628211UL;
+	return h ? h : 1;
+}
+
+Slot *
+lookup(uint64_t h) {
+	Slot *slots = (Slot *)(store + 1);
+	uint32_t i, mask = store->cap - 1;
+
+	/* linear probing; the store is at most half full */
+	for (i = h & mask; slots[i].hash && slots[i].hash != h; i = (i + 1) & mask);
+	return &slots[i];
+}
+
+void
+mapstore(void) {
+	struct stat st;
+
+	if (store)
+		munmap(store, storesize);
+	store = NULL;
+	if (fstat(storefd, &st) < 0 || (size_t)st.st_size < sizeof *store)
+		return;
+	storesize = st.st_size;
+	if ((store = mmap(NULL, storesize, PROT_READ | PROT_WRITE, MAP_SHARED, storefd, 0)) == MAP_FAILED)
+		store = NULL;
+	else if (memcmp(store->magic, HISTORYMAGIC, sizeof store->magic) || store->version != HISTORYVERSION
+	|| !store->cap || (store->cap & (store->cap - 1)) || storesize < sizeof *store + store->cap * sizeof(Slot)) {
+		fprintf(stderr, "ignoring bad history %s\n", storepath);
+		munmap(store, storesize);
+		store = NULL;
+	}
+}
+
+void
+openhistory(const char *path) {
+	Header h;
+
+	/* mapped as is: lookups are a hash and a probe, nothing is parsed */
+	storepath = path;
+	now = time(NULL);
+	if ((storefd = open(path, O_RDWR | O_CREAT, 0600)) < 0) {
+		perror(path);
+		return;
+	}
+	flock(storefd, LOCK_EX);
+	if (lseek(storefd, 0, SEEK_END) == 0) {
+		memset(&h, 0, sizeof h);
+		memcpy(h.magic, HISTORYMAGIC, sizeof h.magic);
+		h.version = HISTORYVERSION;
+		h.cap = HISTORYMIN;
+		if (write(storefd, &h, sizeof h) != sizeof h || ftruncate(storefd, sizeof h + HISTORYMIN * sizeof(Slot)) < 0)
+			perror(path);
+	}
+	flock(storefd, LOCK_UN);
+	mapstore();
+}
+
+void
+recordhistory(const char *text) {
+	char tmp[BUFSIZ];
+	struct stat a, b;
+	Header *old, *grown;
+	Slot *s, *slots;
+	uint64_t h;
+	uint32_t i;
+	int fd;
+
+	if (!store)
+		return;
+	/* another menu may have grown the store and renamed a new one over it */
+	for (;;) {
+		flock(storefd, LOCK_EX);
+		if (stat(storepath, &a) < 0 || fstat(storefd, &b) < 0) {
+			perror(storepath);
+			flock(storefd, LOCK_UN);
+			return;
+		}
+		if (a.st_dev == b.st_dev && a.st_ino == b.st_ino)
+			break;
+		close(storefd);
+		if ((storefd = open(storepath, O_RDWR)) < 0) {
+			perror(storepath);
+			return;
+		}
+	}
+	mapstore();
+	if (store && (store->n + 1) * 2 > store->cap) {
+		/* more than half full: rehash into a store twice the size, locked
+		 * before it is renamed over the old one */
+		if (snprintf(tmp, sizeof tmp, "%s.XXXXXX", storepath) >= (int)sizeof tmp || (fd = mkstemp(tmp)) < 0) {
+			perror(storepath);
+			flock(storefd, LOCK_UN);
+			return;
+		}
+		flock(fd, LOCK_EX);
+		if (ftruncate(fd, sizeof *store + 2 * store->cap * sizeof(Slot)) < 0
+		|| (grown = mmap(NULL, sizeof *store + 2 * store->cap * sizeof(Slot), PROT_READ | PROT_WRITE,
+		                 MAP_SHARED, fd, 0)) == MAP_FAILED) {
+			perror(storepath);
+			unlink(tmp);
+			close(fd);
+			flock(storefd, LOCK_UN);
+			return;
+		}
+		/* rehash the old slots into the new table */
+		*grown = *store;
+		grown->cap = 2 * store->cap;
+		old = store;
+		store = grown;
+		slots = (Slot *)(old + 1);
+		for (i = 0; i < old->cap; i++)
+			if (slots[i].hash)
+				*lookup(slots[i].hash) = slots[i];
+		munmap(old, storesize);
+		storesize = sizeof *store + store->cap * sizeof(Slot);
+		if (rename(tmp, storepath) < 0)
+			perror(storepath);
+		close(storefd);
+		storefd = fd;
+	}
+	if (store) {
+		h = hash(text, strlen(text));
+		if (!(s = lookup(h))->hash) {
+			s->hash = h;
+			store->n++;
+		}
+		s->count++;
+		s->last = time(NULL);
+	}
+	flock(storefd, LOCK_UN);
+}
@@ -0,0 +1,7 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <stddef.h>
+
+int frecency(const char *text, size_t len);
+void openhistory(const char *path);
+void recordhistory(const char *text);
@@ -0,0 +1,787 @@
+/* See LICENSE file for copyright and license details. */
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "history.h"
+#include "match.h"
+#include "search.h"
+#include "trigram.h"
+#include "util.h"
+
+#define MIN(a,b)             ((a) < (b) ? (a) : (b))
+#define MAX(a,b)             ((a) > (b) ? (a) : (b))
+#define SLABSIZE (2 << 20) /* item text arena chunk, one x86-64 huge page */
+#define SPLITMIN (1 << 15) /* fewer candidates than this are scanned serially */
+#define MAXWORKERS 64
+#define SCOREMAX (INT_MAX / 2) /* fuzzy rank is SCOREMAX minus the score */
+#define SAMPLEMAX (1 << 16) /* items counted for token statistics before thinning out */
+#define INDEXMAGIC "dmenuidx"
+#define INDEXVERSION 1
+#define INDEXFOLD 1 /* the index holds a case-folded copy of the text */
+
+typedef struct {
+	char *text;          /* query these results belong to */
+	uint32_t *idx;       /* matching items, in input order */
+	int *rank;           /* tier or fuzzy rank of each match, lower is better */
+	size_t n, cap;
+} Frame;
+
+typedef struct {
+	int rank;
+	uint32_t idx;
+} Rank;
+
+typedef struct {
+	uint32_t *idx;
+	size_t n, cap;
+} List;
+
+/* an --index file, in native byte order: this header, then uint32_t
+ * offsets[n] and lengths[n], then the NUL-terminated text, then the
+ * same text case-folded, at the same offsets */
+typedef struct {
+	char magic[8];
+	uint32_t version, flags;
+	uint64_t n, textsize;
+} IndexHeader;
+
+static void additem(char *s, size_t len);
+static void appendlist(List *l, uint32_t idx);
+static int cmpfrecency(const void *a, const void *b);
+static int cmprank(const void *a, const void *b);
+static uint32_t frequency(const char *s, size_t len);
+static void growframe(Frame *f, size_t n);
+static void growitems(size_t n);
+static void jointiers(void);
+static void linkbest(void);
+static void linkframe(Frame *f, size_t from);
+static void narrow(Frame *f, Frame *parent, size_t from);
+static void narrowrange(Frame *f, Frame *parent, size_t from, size_t end);
+static void offerbest(int rank, uint32_t idx);
+static void sampleitems(void);
+static void siftbest(size_t i);
+static char *slaballoc(size_t size);
+static void startworkers(void);
+static void tokenize(const char *s);
+static void *worker(void *arg);
+
+Item *items = NULL;
+size_t nitems = 0;
+uint32_t *matches = NULL;
+size_t nmatches = 0;
+size_t tiersize[3];
+unsigned long listserial = 0;
+int restsorted = 1;
+int casefold = 0;
+int pagesize = 8;
+int (*fmatch)(Item *item) = matchstr;
+
+static size_t itemcap = 0;
+static char *inputline, *inputfill, *inputend; /* partial line in the arena */
+static size_t matchcap = 0;
+static List tiers[3]; /* results by rank: exact, prefix, substring */
+static Rank *favs = NULL; /* results picked before, ahead of their tier */
+static size_t nfav = 0, favcap = 0;
+static Frame *frames = NULL; /* results of each query the current one extends */
+static size_t nframes = 0, framecap = 0;
+static char query[BUFSIZ], tokbuf[BUFSIZ];
+static char **tokv = NULL;
+static int tokc = 0;
+static size_t querylen, *tokl = NULL;
+static int *tokord = NULL;  /* token indices, rarest first */
+static uint32_t *tokf = NULL; /* estimated frequency of each token */
+static uint32_t bytefreq[256], pairfreq[1 << 16]; /* in a sample of the folded text */
+static size_t sampled = 0, samplestride = 1;
+static Rank *best = NULL; /* fuzzy: bounded max-heap of the top ranks, worst first */
+static size_t nbest = 0, bestcap = 0;
+static size_t nscored = 0; /* items with a frecency score */
+static Frame chunks[MAXWORKERS]; /* each worker's share of a parallel scan */
+static int nworkers = 1, poolstarted = 0;
+static pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolwake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pooldone = PTHREAD_COND_INITIALIZER;
+static unsigned long poolgen = 0;
+static int poolbusy = 0;
+static struct { Frame *parent; size_t from, end; } job;
+
+void
+additem(char *s, size_t len) {
+	static char *fill = NULL, *end = NULL;
+
+	growitems(1);
+	items[nitems].text = items[nitems].fold = s;
+	items[nitems].len = len;
+	items[nitems].width = 0;
+	if ((items[nitems].score = frecency(s, len)))
+		nscored++;
+	if (casefold) {
+		/* folded copies go to their own slabs, matching only reads those */
+		if ((size_t)(end - fill) < len + 1) {
+			fill = slaballoc(MAX(SLABSIZE, len + 1));
+			end = fill + MAX(SLABSIZE, len + 1);
+		}
+		foldcase(items[nitems].fold = fill, s, len + 1);
+		fill += len + 1;
+	}
+	items[++nitems].text = NULL;
+}
+
+void
+appendlist(List *l, uint32_t idx) {
+	if (l->n == l->cap && !(l->idx = realloc(l->idx, (l->cap = l->cap ? 2 * l->cap : BUFSIZ) * sizeof *l->idx)))
+		eprintf("cannot realloc %u bytes:", l->cap * sizeof *l->idx);
+	l->idx[l->n++] = idx;
+}
+
+int
+cmpfrecency(const void *a, const void *b) {
+	const Rank *x = a, *y = b;
+
+	if (x->rank != y->rank)
+		return x->rank < y->rank ? -1 : 1;
+	if (items[x->idx].score != items[y->idx].score)
+		return items[x->idx].score > items[y->idx].score ? -1 : 1;
+	return x->idx < y->idx ? -1 : x->idx > y->idx;
+}
+
+int
+cmprank(const void *a, const void *b) {
+	const Rank *x = a, *y = b;
+
+	if (x->rank != y->rank)
+		return x->rank < y->rank ? -1 : 1;
+	return x->idx < y->idx ? -1 : x->idx > y->idx;
+}
+
+uint32_t
+frequency(const char *s, size_t len) {
+	const unsigned char *u = (const unsigned char *)s;
+	uint32_t f, min = bytefreq[u[0]];
+	size_t i;
+
+	/* a token is at most as common as its rarest byte pair */
+	for (i = 0; i + 1 < len; i++)
+		if ((f = pairfreq[u[i] << 8 | u[i+1]]) < min)
+			min = f;
+	return min;
+}
+
+void
+growframe(Frame *f, size_t n) {
+	if (f->n + n <= f->cap)
+		return;
+	while (f->n + n > f->cap)
+		f->cap = f->cap ? 2 * f->cap : BUFSIZ;
+	if (!(f->idx = realloc(f->idx, f->cap * sizeof *f->idx))
+	|| !(f->rank = realloc(f->rank, f->cap * sizeof *f->rank)))
+		eprintf("cannot realloc %u bytes:", f->cap * sizeof *f->idx);
+}
+
+void
+growitems(size_t n) {
+	/* grow the index geometrically, always keeping room for the sentinel;
+	 * results are indices, so nothing needs to follow it when it moves */
+	if (nitems + n < itemcap)
+		return;
+	while (nitems + n >= itemcap)
+		itemcap = itemcap ? 2 * itemcap : BUFSIZ;
+	if (!(items = realloc(items, itemcap * sizeof *items)))
+		eprintf("cannot realloc %u bytes:", itemcap * sizeof *items);
+}
+
+void
+jointiers(void) {
+	size_t f = 0, n;
+	int i;
+
+	/* copy the tiers into one array, best rank first, each led by the
+	 * results picked before */
+	listserial++;
+	n = nfav;
+	for (i = 0; i < (int)(sizeof tiers / sizeof *tiers); i++)
+		n += tiers[i].n;
+	if (n > matchcap && !(matches = realloc(matches, (matchcap = n) * sizeof *matches)))
+		eprintf("cannot realloc %u bytes:", matchcap * sizeof *matches);
+	for (nmatches = 0, i = 0; i < (int)(sizeof tiers / sizeof *tiers); i++) {
+		for (tiersize[i] = 0; f < nfav && favs[f].rank == i; f++)
+			matches[nmatches + tiersize[i]++] = favs[f].idx;
+		if (tiers[i].n)
+			memcpy(&matches[nmatches + tiersize[i]], tiers[i].idx, tiers[i].n * sizeof *matches);
+		tiersize[i] += tiers[i].n;
+		nmatches += tiersize[i];
+	}
+}
+
+void
+linkbest(void) {
+	static Rank *sorted = NULL;
+	static size_t cap = 0;
+	size_t i;
+
+	/* the heap is small: rank a copy of it into the first tier */
+	if (nbest > cap && !(sorted = realloc(sorted, (cap = bestcap) * sizeof *sorted)))
+		eprintf("cannot realloc %u bytes:", cap * sizeof *sorted);
+	memcpy(sorted, best, nbest * sizeof *best);
+	qsort(sorted, nbest, sizeof *sorted, cmprank);
+	tiers[0].n = 0;
+	for (i = 0; i < nbest; i++)
+		appendlist(&tiers[0], sorted[i].idx);
+}
+
+void
+linkframe(Frame *f, size_t from) {
+	size_t i, j, end = f ? f->n : nitems;
+	int r;
+
+	/* starting over: empty the lists */
+	if (from == 0) {
+		for (r = 0; r < (int)(sizeof tiers / sizeof *tiers); r++)
+			tiers[r].n = 0;
+		nfav = nbest = 0;
+		restsorted = 1;
+	}
+	/* fuzzy results: only rank the few that can be shown, the second
+	 * tier holds the rest in no particular order until paged to */
+	if (f && fmatch == matchfuzzy) {
+		bestcap = MAX(16, 2 * pagesize);
+		if (!(best = realloc(best, bestcap * sizeof *best)))
+			eprintf("cannot realloc %u bytes:", bestcap * sizeof *best);
+		for (i = from; i < end; i++)
+			offerbest(f->rank[i], f->idx[i]);
+		linkbest();
+		return;
+	}
+	/* items picked before go ahead of the rest of their tier, so new
+	 * lines holding one mean starting over */
+	if (nscored && from > 0)
+		for (i = from; i < end; i++)
+			if (items[f ? f->idx[i] : i].score) {
+				linkframe(f, 0);
+				return;
+			}
+	/* append results to the tier lists; no frame means every item */
+	for (i = from; i < end; i++) {
+		j = f ? f->idx[i] : i;
+		r = f ? f->rank[i] : 0;
+		if (!items[j].score) {
+			appendlist(&tiers[r], j);
+			continue;
+		}
+		if (nfav == favcap && !(favs = realloc(favs, (favcap = favcap ? 2 * favcap : 64) * sizeof *favs)))
+			eprintf("cannot realloc %u bytes:", favcap * sizeof *favs);
+		favs[nfav].rank = r;
+		favs[nfav++].idx = j;
+	}
+	/* by tier, most frecent first */
+	if (nfav)
+		qsort(favs, nfav, sizeof *favs, cmpfrecency);
+}
+
+int
+matchfuzzy(Item *item) {
+	const char *t = item->fold, *end = t + item->len, *p, *b;
+	size_t i;
+	int score = 0, run = 0;
+
+	if (!querylen)
+		return 0;
+	/* find the first window holding the query as a subsequence... */
+	for (i = 0, p = t; i < querylen; i++, p++)
+		if (!(p = findchr(p, end - p, query[i])))
+			return -1;
+	/* ...and shrink it from the left by matching backwards */
+	for (i = querylen, b = p; i-- > 0; )
+		while (*--b != query[i])
+			(void)0;
+	/* reward runs and matches at word starts, punish gaps */
+	for (i = 0; i < querylen; b++) {
+		if (*b != query[i]) {
+			score -= run ? 3 : 1;
+			run = 0;
+			continue;
+		}
+		score += 16;
+		if (b == t || b[-1] == '/')
+			score += 32;
+		else if (strchr(" -_.:", b[-1]))
+			score += 24;
+		else if (isupper((unsigned char)item->text[b - t]) && islower((unsigned char)item->text[b - t - 1]))
+			score += 16;
+		if (run)
+			score += 24;
+		run = 1;
+		i++;
+	}
+	/* items picked before are worth up to a few more matched characters */
+	return SCOREMAX - score - MIN(item->score / 4, 128);
+}
+
+void
+matchquery(const char *text) {
+	static Frame cand; /* items the trigram index could not rule out */
+	Frame *f, *parent;
+
+	tokenize(text);
+	/* forget results of queries the new one does not extend */
+	while (nframes && strncmp(frames[nframes-1].text, text, strlen(frames[nframes-1].text)))
+		nframes--;
+	/* narrow the closest earlier results, unless we are back at them */
+	if (*text && (!nframes || strcmp(frames[nframes-1].text, text))) {
+		if (nframes == framecap) {
+			framecap = framecap ? 2 * framecap : 16;
+			if (!(frames = realloc(frames, framecap * sizeof *frames)))
+				eprintf("cannot realloc %u bytes:", framecap * sizeof *frames);
+			memset(&frames[nframes], 0, (framecap - nframes) * sizeof *frames);
+		}
+		f = &frames[nframes++];
+		if (!(f->text = realloc(f->text, strlen(text) + 1)))
+			eprintf("cannot realloc %u bytes:", strlen(text) + 1);
+		strcpy(f->text, text);
+		f->n = 0;
+		parent = nframes > 1 ? &frames[nframes-2] : NULL;
+		/* substring tokens: scan the index's candidates if there are fewer */
+		if (fmatch != matchfuzzy && trigramcandidates(tokv, tokl, tokc, &cand.idx, &cand.n)
+		&& cand.n < (parent ? parent->n : nitems))
+			parent = &cand;
+		narrow(f, parent, 0);
+	}
+	linkframe(nframes ? &frames[nframes-1] : NULL, 0);
+	jointiers();
+}
+
+int
+matchstr(Item *item) {
+	int i;
+
+	for (i = 0; i < tokc; i++)
+		if (!findstr(item->fold, item->len, tokv[tokord[i]], tokl[tokord[i]]))
+			return -1; /* not all tokens match */
+	/* exact matches go first, then prefixes, then substrings */
+	if (!tokc || (item->len == tokl[0] && !memcmp(tokv[0], item->fold, tokl[0])))
+		return 0;
+	else if (item->len > tokl[0] && !memcmp(tokv[0], item->fold, tokl[0]))
+		return 1;
+	return 2;
+}
+
+int
+matchtok(Item *item) {
+	int i;
+
+	for (i = 0; i < tokc; i++)
+		if (!findstr(item->fold, item->len, tokv[tokord[i]], tokl[tokord[i]]))
+			return -1;
+	return 0;
+}
+
+void
+narrow(Frame *f, Frame *parent, size_t from) {
+	size_t end = parent ? parent->n : nitems;
+	int i;
+
+	/* test the parent's results from the given one on, or every item
+	 * from the given index on when there is no parent; the pool is only
+	 * started once a scan is big enough to split */
+	if (end - from >= SPLITMIN && !poolstarted)
+		startworkers();
+	if (nworkers < 2 || end - from < SPLITMIN) {
+		narrowrange(f, parent, from, end);
+		return;
+	}
+	/* split the scan into one chunk per worker; concatenating the chunks
+	 * in order gives the same result as a serial scan */
+	pthread_mutex_lock(&poollock);
+	job.parent = parent;
+	job.from = from;
+	job.end = end;
+	poolbusy = nworkers - 1;
+	poolgen++;
+	pthread_cond_broadcast(&poolwake);
+	pthread_mutex_unlock(&poollock);
+
+	chunks[0].n = 0;
+	narrowrange(&chunks[0], parent, from, from + (end - from) / nworkers);
+
+	pthread_mutex_lock(&poollock);
+	while (poolbusy)
+		pthread_cond_wait(&pooldone, &poollock);
+	pthread_mutex_unlock(&poollock);
+
+	for (i = 0; i < nworkers; i++) {
+		growframe(f, chunks[i].n);
+		memcpy(&f->idx[f->n], chunks[i].idx, chunks[i].n * sizeof *f->idx);
+		memcpy(&f->rank[f->n], chunks[i].rank, chunks[i].n * sizeof *f->rank);
+		f->n += chunks[i].n;
+	}
+}
+
+void
+narrowrange(Frame *f, Frame *parent, size_t from, size_t end) {
+	size_t i, j;
+	int r;
+
+	for (i = from; i < end; i++) {
+		j = parent ? parent->idx[i] : i;
+		if ((r = fmatch(&items[j])) < 0)
+			continue;
+		growframe(f, 1);
+		f->idx[f->n] = j;
+		f->rank[f->n++] = r;
+	}
+}
+
+void
+offerbest(int rank, uint32_t idx) {
+	Rank r = { rank, idx };
+
+	/* keep the best bestcap results in the heap, the rest in tier two */
+	if (nbest < bestcap) {
+		best[nbest] = r;
+		for (idx = nbest++; idx > 0 && cmprank(&best[(idx-1)/2], &best[idx]) < 0; idx = (idx-1)/2) {
+			r = best[idx];
+			best[idx] = best[(idx-1)/2];
+			best[(idx-1)/2] = r;
+		}
+		return;
+	}
+	if (cmprank(&r, &best[0]) < 0) {
+		idx = best[0].idx;
+		best[0] = r;
+		siftbest(0);
+	}
+	appendlist(&tiers[1], idx);
+	restsorted = 0;
+}
+
+int
+readchunk(void) {
+	char *p;
+	size_t len;
+	ssize_t n;
+
+	/* read once from stdin straight into the text arena, splitting lines in
+	 * place; returns 0 at end of input */
+	if (inputfill == inputend) {
+		/* slab is full: carry the partial line over to a fresh one */
+		len = inputfill - inputline;
+		p = slaballoc(MAX(SLABSIZE, 2 * len + 1));
+		if (len)
+			memcpy(p, inputline, len);
+		inputend = p + MAX(SLABSIZE, 2 * len + 1);
+		inputfill = p + len;
+		inputline = p;
+	}
+	if ((n = read(STDIN_FILENO, inputfill, inputend - inputfill)) < 0) {
+		if (errno == EINTR)
+			return 1;
+		eprintf("cannot read stdin:");
+	}
+	if (n == 0) {
+		if (inputfill > inputline) {
+			/* last line lacks a newline; there is always room for its NUL */
+			*inputfill = '\0';
+			additem(inputline, inputfill - inputline);
+			inputline = inputfill;
+		}
+		sampleitems();
+		return 0;
+	}
+	for (p = inputfill, inputfill += n; (p = memchr(p, '\n', inputfill - p)); inputline = ++p) {
+		*p = '\0';
+		additem(inputline, p - inputline);
+	}
+	sampleitems();
+	return 1;
+}
+
+void
+readindex(const char *path) {
+	const IndexHeader *h;
+	const uint32_t *off, *len;
+	struct stat st;
+	char *text, *fold;
+	size_t i;
+	int fd;
+
+	/* map the index read-only: items point straight into it */
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+		eprintf("cannot open index %s:", path);
+	if ((size_t)st.st_size < sizeof *h
+	|| (h = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+		eprintf("cannot map index %s\n", path);
+	close(fd);
+	if (memcmp(h->magic, INDEXMAGIC, sizeof h->magic) || h->version != INDEXVERSION
+	|| !h->textsize || h->textsize > (uint64_t)st.st_size || h->n > UINT32_MAX
+	|| (size_t)st.st_size < sizeof *h + 2 * h->n * sizeof *off + h->textsize * ((h->flags & INDEXFOLD) ? 2 : 1))
+		eprintf("bad index %s\n", path);
+	off = (const uint32_t *)(h + 1);
+	len = off + h->n;
+	text = (char *)(len + h->n);
+	fold = text + h->textsize;
+	/* every string ends in a NUL inside the text: items are used as C strings */
+	if (casefold && !(h->flags & INDEXFOLD)) {
+		/* no folded copy to share, fold the usual way */
+		for (i = 0; i < h->n; i++) {
+			if ((uint64_t)off[i] + len[i] >= h->textsize || text[off[i] + len[i]])
+				eprintf("bad index %s\n", path);
+			additem(text + off[i], len[i]);
+		}
+		return;
+	}
+	growitems(h->n);
+	for (i = 0; i < h->n; i++) {
+		if ((uint64_t)off[i] + len[i] >= h->textsize || text[off[i] + len[i]]
+		|| ((h->flags & INDEXFOLD) && fold[off[i] + len[i]]))
+			eprintf("bad index %s\n", path);
+		items[nitems].text = text + off[i];
+		items[nitems].fold = casefold ? fold + off[i] : items[nitems].text;
+		items[nitems].len = len[i];
+		items[nitems].width = 0;
+		if ((items[nitems].score = frecency(items[nitems].text, len[i])))
+			nscored++;
+		nitems++;
+	}
+	items[nitems].text = NULL;
+}
+
+int
+readmatches(void) {
+	size_t i, from, done, n = nitems;
+	int more = readchunk();
+
+	/* apply the current query to the lines that just arrived */
+	if (nitems > n) {
+		/* bring every stacked query up to date, each from its parent */
+		from = n;
+		for (i = 0; i < nframes; i++) {
+			tokenize(frames[i].text);
+			done = frames[i].n;
+			narrow(&frames[i], i ? &frames[i-1] : NULL, from);
+			from = done;
+		}
+		linkframe(nframes ? &frames[nframes-1] : NULL, from);
+		jointiers();
+	}
+	return more;
+}
+
+void
+readstdin(void) {
+	while (readchunk())
+		(void)0;
+}
+
+void
+sampleitems(void) {
+	const unsigned char *p, *end;
+
+	/* count the bytes and byte pairs of every item at first, of fewer and
+	 * fewer as the input grows: enough to tell rare tokens from common */
+	for (; sampled < nitems; sampled++) {
+		if (sampled == SAMPLEMAX * samplestride)
+			samplestride *= 2;
+		if (sampled & (samplestride - 1))
+			continue;
+		p = (const unsigned char *)items[sampled].fold;
+		for (end = p + items[sampled].len; p < end; p++) {
+			bytefreq[p[0]]++;
+			if (p + 1 < end)
+				pairfreq[p[0] << 8 | p[1]]++;
+		}
+	}
+}
+
+void
+siftbest(size_t i) {
+	size_t c;
+	Rank r;
+
+	/* move best[i] down until both children rank ahead of it */
+	for (; (c = 2 * i + 1) < nbest; i = c) {
+		if (c + 1 < nbest && cmprank(&best[c+1], &best[c]) > 0)
+			c++;
+		if (cmprank(&best[c], &best[i]) <= 0)
+			break;
+		r = best[i];
+		best[i] = best[c];
+		best[c] = r;
+	}
+}
+
+char *
+slaballoc(size_t size) {
+	static size_t total = 0;
+	char *p;
+
+	if ((p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+		eprintf("cannot mmap %u bytes:", size);
+#ifdef MADV_HUGEPAGE
+	/* only ask for huge pages once the input outgrows the first slab,
+	 * so small menus do not pay for a 2M page they never fill */
+	if (total)
+		madvise(p, size, MADV_HUGEPAGE);
+#endif
+	total += size;
+	return p;
+}
+
+void
+sortrest(void) {
+	static Rank *sorted = NULL;
+	static size_t cap = 0;
+	Frame *f = &frames[nframes-1];
+	size_t i;
+
+	/* somebody wants to see past the best: rank every fuzzy result */
+	if (restsorted)
+		return;
+	if (f->n > cap && !(sorted = realloc(sorted, (cap = f->n) * sizeof *sorted)))
+		eprintf("cannot realloc %u bytes:", cap * sizeof *sorted);
+	for (i = 0; i < f->n; i++) {
+		sorted[i].rank = f->rank[i];
+		sorted[i].idx = f->idx[i];
+	}
+	qsort(sorted, f->n, sizeof *sorted, cmprank);
+	tiers[0].n = tiers[1].n = 0;
+	for (i = 0; i < f->n; i++)
+		appendlist(&tiers[i >= nbest], sorted[i].idx);
+	/* the heap must hold the same best results, worst first */
+	for (i = 0; i < nbest; i++)
+		best[i] = sorted[nbest - 1 - i];
+	jointiers();
+	restsorted = 1;
+}
+
+void
+startworkers(void) {
+	pthread_t tid;
+	long i, n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	/* the main thread scans the first chunk itself */
+	poolstarted = 1;
+	for (i = 1; i < MIN(n, MAXWORKERS); i++) {
+		if (pthread_create(&tid, NULL, worker, (void *)i))
+			break;
+		pthread_detach(tid);
+		nworkers++;
+	}
+}
+
+void
+tokenize(const char *s) {
+	static int tokn = 0;
+	char *p;
+	int i, j;
+
+	/* separate the query into tokens to be matched individually, folded
+	 * like the items are */
+	querylen = strlen(s);
+	if (casefold)
+		foldcase(query, s, querylen + 1);
+	else
+		strcpy(query, s);
+	strcpy(tokbuf, query);
+	for (tokc = 0, p = strtok(tokbuf, " "); p; tokv[tokc-1] = p, p = strtok(NULL, " "))
+		if (++tokc > tokn && (!(tokv = realloc(tokv, ++tokn * sizeof *tokv))
+		|| !(tokl = realloc(tokl, tokn * sizeof *tokl))
+		|| !(tokord = realloc(tokord, tokn * sizeof *tokord))
+		|| !(tokf = realloc(tokf, tokn * sizeof *tokf))))
+			eprintf("cannot realloc %u bytes\n", tokn * sizeof *tokv);
+	for (i = 0; i < tokc; i++)
+		tokl[i] = strlen(tokv[i]);
+	/* test the rarest token first, most items fail on it alone; an index
+	 * never went through readchunk(), so it is sampled on first use */
+	if (tokc > 1)
+		sampleitems();
+	for (i = 0; i < tokc; i++) {
+		tokf[i] = tokc > 1 ? frequency(tokv[i], tokl[i]) : 0;
+		for (j = i; j > 0 && tokf[tokord[j-1]] > tokf[i]; j--)
+			tokord[j] = tokord[j-1];
+		tokord[j] = i;
+	}
+}
+
+void *
+worker(void *arg) {
+	long w = (long)arg;
+	unsigned long gen = 0;
+	size_t len;
+
+	for (;;) {
+		pthread_mutex_lock(&poollock);
+		while (poolgen == gen)
+			pthread_cond_wait(&poolwake, &poollock);
+		gen = poolgen;
+		pthread_mutex_unlock(&poollock);
+
+		len = job.end - job.from;
+		chunks[w].n = 0;
+		narrowrange(&chunks[w], job.parent, job.from + len * w / nworkers,
+		            job.from + len * (w + 1) / nworkers);
+
+		pthread_mutex_lock(&poollock);
+		if (--poolbusy == 0)
+			pthread_cond_signal(&pooldone);
+		pthread_mutex_unlock(&poollock);
+	}
+	return NULL;
+}
+
+void
+writeindex(const char *path) {
+	IndexHeader h;
+	char tmp[PATH_MAX], buf[BUFSIZ];
+	uint32_t v;
+	size_t i, j, n;
+	FILE *fp;
+	int fd;
+
+	/* written beside the target and renamed over it, never seen half done */
+	memset(&h, 0, sizeof h);
+	memcpy(h.magic, INDEXMAGIC, sizeof h.magic);
+	h.version = INDEXVERSION;
+	h.flags = INDEXFOLD;
+	h.n = nitems;
+	for (i = 0; i < nitems; i++)
+		h.textsize += items[i].len + 1;
+	if (!h.textsize)
+		h.textsize = 1; /* an empty index still ends in a NUL */
+	if (h.textsize > UINT32_MAX)
+		eprintf("too much text for an index\n");
+	if (snprintf(tmp, sizeof tmp, "%s.XXXXXX", path) >= (int)sizeof tmp
+	|| (fd = mkstemp(tmp)) < 0 || !(fp = fdopen(fd, "w")))
+		eprintf("cannot create index %s:", path);
+	fwrite(&h, sizeof h, 1, fp);
+	for (i = 0, v = 0; i < nitems; v += items[i++].len + 1)
+		fwrite(&v, sizeof v, 1, fp);
+	for (i = 0; i < nitems; i++) {
+		v = items[i].len;
+		fwrite(&v, sizeof v, 1, fp);
+	}
+	/* the text, then its folded copy a chunk at a time */
+	for (i = 0; i < nitems; i++)
+		fwrite(items[i].text, 1, items[i].len + 1, fp);
+	if (!nitems)
+		fputc('\0', fp);
+	for (i = 0; i < nitems; i++)
+		for (j = 0; j <= items[i].len; j += n) {
+			n = MIN(sizeof buf, items[i].len + 1 - j);
+			foldcase(buf, items[i].text + j, n);
+			fwrite(buf, 1, n, fp);
+		}
+	if (!nitems)
+		fputc('\0', fp);
+	if (fflush(fp) == EOF || ferror(fp) || fsync(fileno(fp)) < 0 || fclose(fp) == EOF || rename(tmp, path) < 0) {
+		unlink(tmp);
+		eprintf("cannot write index %s:", path);
+	}
+}
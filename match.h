@@ -0,0 +1,38 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* the ith result of the current query */
+#define MATCH(i) (&items[matches[(i)]])
+
+typedef struct Item Item;
+struct Item {
+	char *text;
+	char *fold; /* case-folded copy with -i, text otherwise */
+	size_t len;
+	int width;  /* textw() of text, 0 until measured */
+	int score;  /* frecency from the --history store, 0 if never picked */
+};
+
+extern Item *items;         /* every line read, NULL-terminated */
+extern size_t nitems;
+extern uint32_t *matches;   /* results as indices into items, best rank first */
+extern size_t nmatches;
+extern size_t tiersize[3];  /* results of each rank: exact, prefix, substring */
+extern unsigned long listserial; /* bumped whenever the results change */
+extern int restsorted;      /* whether the fuzzy results after the best are ranked */
+extern int casefold;
+extern int pagesize;        /* how many results fit on screen */
+extern int (*fmatch)(Item *item);
+
+int matchfuzzy(Item *item);
+void matchquery(const char *text);
+int matchstr(Item *item);
+int matchtok(Item *item);
+int readchunk(void);
+void readindex(const char *path);
+int readmatches(void);
+void readstdin(void);
+void sortrest(void);
+void writeindex(const char *path);
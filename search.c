@@ -0,0 +1,149 @@
+/* See LICENSE file for copyright and license details. */
+#include <string.h>
+#include "search.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD
+#include <immintrin.h>
+#endif
+
+static char *findchrscalar(const char *s, size_t n, int c);
+static char *findstrscalar(const char *s, size_t n, const char *sub, size_t m);
+
+char *(*findchr)(const char *s, size_t n, int c) = findchrscalar;
+char *(*findstr)(const char *s, size_t n, const char *sub, size_t m) = findstrscalar;
+
+char *
+findchrscalar(const char *s, size_t n, int c) {
+	return memchr(s, c, n);
+}
+
+char *
+findstrscalar(const char *s, size_t n, const char *sub, size_t m) {
+	const char *p, *end = s + n;
+
+	if(m == 0)
+		return (char *)s;
+	for(p = s; (size_t)(end - p) >= m && (p = memchr(p, sub[0], end - p - m + 1)); p++)
+		if(!memcmp(p, sub, m))
+			return (char *)p;
+	return NULL;
+}
+
+#ifdef SIMD
+/* The substring kernels compare the first and the last byte of the needle
+ * against a whole block of the haystack at once and only memcmp() the
+ * candidate positions where both agree.  Loads never cross s + n; the
+ * remainder is left to the scalar kernels. */
+
+__attribute__((target("sse2"))) static char *
+findchrsse2(const char *s, size_t n, int c) {
+	__m128i v = _mm_set1_epi8((char)c);
+	unsigned int mask;
+	size_t i;
+
+	for(i = 0; i + 16 <= n; i += 16)
+		if((mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_loadu_si128((const __m128i *)(s + i))))))
+			return (char *)s + i + __builtin_ctz(mask);
+	return findchrscalar(s + i, n - i, c);
+}
+
+__attribute__((target("sse2"))) static char *
+findstrsse2(const char *s, size_t n, const char *sub, size_t m) {
+	__m128i first, last;
+	unsigned int mask;
+	size_t i;
+
+	if(m == 0 || m > n)
+		return m ? NULL : (char *)s;
+	first = _mm_set1_epi8(sub[0]);
+	last = _mm_set1_epi8(sub[m-1]);
+	for(i = 0; i + m - 1 + 16 <= n; i += 16) {
+		mask = _mm_movemask_epi8(_mm_and_si128(
+			_mm_cmpeq_epi8(first, _mm_loadu_si128((const __m128i *)(s + i))),
+			_mm_cmpeq_epi8(last, _mm_loadu_si128((const __m128i *)(s + i + m - 1)))));
+		for(; mask; mask &= mask - 1)
+			if(!memcmp(s + i + __builtin_ctz(mask), sub, m))
+				return (char *)s + i + __builtin_ctz(mask);
+	}
+	return findstrscalar(s + i, n - i, sub, m);
+}
+
+__attribute__((target("avx2"))) static char *
+findchravx2(const char *s, size_t n, int c) {
+	__m256i v = _mm256_set1_epi8((char)c);
+	unsigned int mask;
+	size_t i;
+
+	for(i = 0; i + 32 <= n; i += 32)
+		if((mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_loadu_si256((const __m256i *)(s + i))))))
+			return (char *)s + i + __builtin_ctz(mask);
+	return findchrsse2(s + i, n - i, c);
+}
+
+__attribute__((target("avx2"))) static char *
+findstravx2(const char *s, size_t n, const char *sub, size_t m) {
+	__m256i first, last;
+	unsigned int mask;
+	size_t i;
+
+	if(m == 0 || m > n)
+		return m ? NULL : (char *)s;
+	first = _mm256_set1_epi8(sub[0]);
+	last = _mm256_set1_epi8(sub[m-1]);
+	for(i = 0; i + m - 1 + 32 <= n; i += 32) {
+		mask = _mm256_movemask_epi8(_mm256_and_si256(
+			_mm256_cmpeq_epi8(first, _mm256_loadu_si256((const __m256i *)(s + i))),
+			_mm256_cmpeq_epi8(last, _mm256_loadu_si256((const __m256i *)(s + i + m - 1)))));
+		for(; mask; mask &= mask - 1)
+			if(!memcmp(s + i + __builtin_ctz(mask), sub, m))
+				return (char *)s + i + __builtin_ctz(mask);
+	}
+	return findstrsse2(s + i, n - i, sub, m);
+}
+
+__attribute__((target("sse2"))) static size_t
+foldsse2(char *dst, const char *src, size_t n) {
+	__m128i v, upper;
+	size_t i;
+
+	/* bytes >= 0x80 compare as negative and are left alone */
+	for(i = 0; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(src + i));
+		upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+		                      _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+		_mm_storeu_si128((__m128i *)(dst + i),
+		                 _mm_add_epi8(v, _mm_and_si128(upper, _mm_set1_epi8('a' - 'A'))));
+	}
+	return i;
+}
+#endif
+
+/* fold ASCII letters to lower case, which is all strncasecmp() would do
+ * for a UTF-8 locale */
+void
+foldcase(char *dst, const char *src, size_t n) {
+	size_t i = 0;
+
+#ifdef SIMD
+	if(__builtin_cpu_supports("sse2"))
+		i = foldsse2(dst, src, n);
+#endif
+	for(; i < n; i++)
+		dst[i] = (src[i] >= 'A' && src[i] <= 'Z') ? src[i] + ('a' - 'A') : src[i];
+}
+
+void
+initsearch(void) {
+#ifdef SIMD
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		findchr = findchravx2;
+		findstr = findstravx2;
+	}
+	else if(__builtin_cpu_supports("sse2")) {
+		findchr = findchrsse2;
+		findstr = findstrsse2;
+	}
+#endif
+}
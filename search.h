@@ -0,0 +1,9 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <stddef.h>
+
+extern char *(*findchr)(const char *s, size_t n, int c);
+extern char *(*findstr)(const char *s, size_t n, const char *sub, size_t m);
+
+void foldcase(char *dst, const char *src, size_t n);
+void initsearch(void);
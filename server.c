@@ -0,0 +1,210 @@
+/* See LICENSE file for copyright and license details. */
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "server.h"
+#include "util.h"
+
+#define LENGTH(x)  (sizeof (x) / sizeof *(x))
+#define MIN(a,b)   ((a) < (b) ? (a) : (b))
+#define MAXSERVED  64
+
+typedef struct {
+	pid_t pid;
+	int conn;
+} Served;
+
+static void onchld(int sig);
+static int reap(pid_t standby);
+
+static Served served[MAXSERVED];
+static size_t nserved = 0;
+
+void
+onchld(int sig) {
+	(void)sig; /* only here to interrupt pselect() */
+}
+
+int
+reap(pid_t standby) {
+	unsigned char status;
+	int st, died = 0;
+	size_t i;
+	pid_t pid;
+
+	while ((pid = waitpid(-1, &st, WNOHANG)) > 0) {
+		if (pid == standby)
+			died = 1;
+		for (i = 0; i < nserved && served[i].pid != pid; i++);
+		if (i == nserved)
+			continue;
+		/* the menu's exit status is its client's */
+		status = WIFEXITED(st) ? WEXITSTATUS(st) : EXIT_FAILURE;
+		send(served[i].conn, &status, 1, MSG_NOSIGNAL);
+		close(served[i].conn);
+		served[i] = served[--nserved];
+	}
+	return died;
+}
+
+int
+recvfds(int sock, void *buf, size_t size, int *fds, int *nfds) {
+	union { struct cmsghdr h; char buf[CMSG_SPACE(MAXFDS * sizeof(int))]; } ctl;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t n;
+	int max = *nfds;
+
+	memset(&msg, 0, sizeof msg);
+	iov.iov_base = buf;
+	iov.iov_len = size;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof ctl.buf;
+	while ((n = recvmsg(sock, &msg, 0)) < 0 && errno == EINTR);
+	if (n < 0)
+		return -1;
+	*nfds = 0;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			*nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), MIN(*nfds, max) * sizeof(int));
+			while (*nfds > max)
+				close(((int *)CMSG_DATA(cmsg))[--*nfds]);
+		}
+	return (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ? -1 : n;
+}
+
+int
+request(int conn, char *buf, size_t size, char **argv, int maxargs) {
+	int fds[MAXFDS], nfds = MAXFDS, argc = 0, i;
+	char *p;
+	int n;
+
+	/* one packet: the client's argv, NUL separated, and its stdio */
+	if ((n = recvfds(conn, buf, size - 1, fds, &nfds)) < 0 || nfds != MAXFDS) {
+		for (i = 0; i < nfds; i++)
+			close(fds[i]);
+		return -1;
+	}
+	for (i = 0; i < nfds; i++)
+		if (fds[i] != i) {
+			if (dup2(fds[i], i) < 0)
+				eprintf("cannot take over client fd %d:", i);
+			close(fds[i]);
+		}
+	buf[n] = '\0';
+	for (p = buf; p < buf + n && argc < maxargs - 1; p += strlen(p) + 1)
+		argv[argc++] = p;
+	argv[argc] = NULL;
+	return argc;
+}
+
+int
+sendfds(int sock, const void *buf, size_t len, const int *fds, int nfds) {
+	union { struct cmsghdr h; char buf[CMSG_SPACE(MAXFDS * sizeof(int))]; } ctl;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+
+	memset(&msg, 0, sizeof msg);
+	memset(&ctl, 0, sizeof ctl);
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 ? -1 : 0;
+}
+
+int
+serve(const char *path, void (*standby)(void)) {
+	struct sockaddr_un sa;
+	struct sigaction sig;
+	sigset_t block, orig;
+	fd_set fds;
+	int lfd, ctl = -1, conn, nfds, pair[2];
+	char c = 0;
+	size_t i;
+	pid_t pid = 0;
+
+	memset(&sa, 0, sizeof sa);
+	sa.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof sa.sun_path)
+		eprintf("socket path too long: %s\n", path);
+	strcpy(sa.sun_path, path);
+	if ((lfd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0)
+		eprintf("cannot create socket:");
+	unlink(path); /* left behind by a previous daemon */
+	if (bind(lfd, (struct sockaddr *)&sa, sizeof sa) < 0 || listen(lfd, 8) < 0)
+		eprintf("cannot listen on %s:", path);
+
+	/* SIGCHLD is only let through while waiting for the next client */
+	memset(&sig, 0, sizeof sig);
+	sig.sa_handler = onchld;
+	sigaction(SIGCHLD, &sig, NULL);
+	sigemptyset(&block);
+	sigaddset(&block, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &block, &orig);
+
+	for (;;) {
+		if (!pid) {
+			/* keep one menu ready: connected, fonts loaded, window created */
+			if (socketpair(AF_UNIX, SOCK_DGRAM, 0, pair) < 0)
+				eprintf("cannot create socketpair:");
+			if ((pid = fork()) < 0)
+				eprintf("cannot fork:");
+			if (pid == 0) {
+				sigprocmask(SIG_SETMASK, &orig, NULL);
+				signal(SIGCHLD, SIG_DFL);
+				close(lfd);
+				close(pair[0]);
+				for (i = 0; i < nserved; i++)
+					close(served[i].conn);
+				standby();
+				nfds = 1;
+				if (recvfds(pair[1], &c, 1, &conn, &nfds) < 0 || nfds != 1)
+					exit(EXIT_FAILURE);
+				close(pair[1]);
+				return conn;
+			}
+			close(pair[1]);
+			ctl = pair[0];
+		}
+		FD_ZERO(&fds);
+		FD_SET(lfd, &fds);
+		if (pselect(lfd + 1, &fds, NULL, NULL, NULL, &orig) < 0) {
+			if (errno != EINTR)
+				eprintf("cannot select:");
+			/* a menu that dies before its client would die again */
+			if (reap(pid))
+				eprintf("menu exited before serving a client\n");
+			continue;
+		}
+		if ((conn = accept(lfd, NULL, NULL)) < 0)
+			continue;
+		if (nserved == LENGTH(served) || sendfds(ctl, &c, 1, &conn, 1) < 0) {
+			close(conn);
+			continue;
+		}
+		served[nserved].pid = pid;
+		served[nserved++].conn = conn;
+		close(ctl);
+		pid = 0;
+	}
+}
@@ -0,0 +1,8 @@
+/* See LICENSE file for copyright and license details. */
+
+#define MAXFDS 3 /* a client passes its stdin, stdout and stderr */
+
+int recvfds(int sock, void *buf, size_t size, int *fds, int *nfds);
+int request(int conn, char *buf, size_t size, char **argv, int maxargs);
+int sendfds(int sock, const void *buf, size_t len, const int *fds, int nfds);
+int serve(const char *path, void (*standby)(void));
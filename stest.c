@@ -1,5 +1,8 @@
 /* See LICENSE file for copyright and license details. */
 #include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,22 +11,53 @@
 #include <sys/stat.h>
 
 #define FLAG(x)  (flag[(x)-'a'])
+#define MAXWORKERS 16
 
-static void test(const char *, const char *);
+typedef struct {
+	const char *arg;
+	char *out;       /* names that passed, one per line */
+	size_t len, cap;
+	struct timespec mtime; /* of the directory, before it was read */
+	bool listed, cached, done;
+} Job;
+
+typedef struct {
+	char *path, *flags, *names;
+	struct timespec mtime;
+	size_t len;
+} Entry;
+
+static void emit(Job *, const char *);
+static void readmanifest(void);
+static void scan(Job *);
+static bool test(int, const char *, const char *, unsigned char);
+static void *walk(void *);
+static void writemanifest(void);
 
 static bool match = false;
 static bool flag[26];
 static struct stat old, new;
+static Job *jobs;
+static size_t njobs, nextjob = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t finished = PTHREAD_COND_INITIALIZER;
+static const char *manifest = NULL; /* -m: directory listings of the last run */
+static char flags[27];
+static Entry *entries = NULL;
+static size_t nentries = 0;
 
 int
 main(int argc, char *argv[]) {
-	struct dirent *d;
 	char buf[BUFSIZ], *p;
-	DIR *dir;
+	pthread_t tid;
+	size_t i, workers = 0;
 	int opt;
 
-	while((opt = getopt(argc, argv, "abcdefghln:o:pqrsuwx")) != -1)
+	while((opt = getopt(argc, argv, "abcdefghlm:n:o:pqrsuwx")) != -1)
 		switch(opt) {
+		case 'm': /* manifest of directory listings */
+			manifest = optarg;
+			break;
 		case 'n': /* newer than file */
 		case 'o': /* older than file */
 			if(!(FLAG(opt) = !stat(optarg, (opt == 'n' ? &new : &old))))
@@ -33,52 +67,246 @@ main(int argc, char *argv[]) {
 			FLAG(opt) = true;
 			break;
 		case '?': /* error: unknown flag */
-			fprintf(stderr, "usage: %s [-abcdefghlpqrsuwx] [-n file] [-o file] [file...]\n", argv[0]);
+			fprintf(stderr, "usage: %s [-abcdefghlpqrsuwx] [-m file] [-n file] [-o file] [file...]\n", argv[0]);
 			exit(2);
 		}
 	if(optind == argc)
 		while(fgets(buf, sizeof buf, stdin)) {
 			if((p = strchr(buf, '\n')))
 				*p = '\0';
-			test(buf, buf);
+			if(test(AT_FDCWD, buf, buf, DT_UNKNOWN)) {
+				if(FLAG('q'))
+					exit(0);
+				match = true;
+				puts(buf);
+			}
 		}
-	for(; optind < argc; optind++)
-		if(FLAG('l') && (dir = opendir(argv[optind]))) {
-			/* test directory contents */
-			while((d = readdir(dir)))
-				if(snprintf(buf, sizeof buf, "%s/%s", argv[optind], d->d_name) < sizeof buf)
-					test(buf, d->d_name);
-			closedir(dir);
+
+	/* scan the arguments in parallel, slow (e.g. network) directories
+	 * overlap, but print them in order as if scanned one by one */
+	/* listings depend on the tests, and go stale with time for -n and -o */
+	if(FLAG('n') || FLAG('o') || !FLAG('l'))
+		manifest = NULL;
+	for(opt = 'a', p = flags; opt <= 'z'; opt++)
+		if(FLAG(opt) && !strchr("lq", opt))
+			*p++ = opt;
+	if(manifest)
+		readmanifest();
+	njobs = argc - optind;
+	if(njobs && !(jobs = calloc(njobs, sizeof *jobs))) {
+		perror("calloc");
+		exit(2);
+	}
+	for(i = 0; i < njobs; i++)
+		jobs[i].arg = argv[optind + i];
+	for(i = 0; i < njobs && i < MAXWORKERS; i++)
+		if(!pthread_create(&tid, NULL, walk, NULL)) {
+			pthread_detach(tid);
+			workers++;
 		}
-		else
-			test(argv[optind], argv[optind]);
+	if(!workers)
+		walk(NULL);
+	for(i = 0; i < njobs; i++) {
+		pthread_mutex_lock(&lock);
+		while(!jobs[i].done)
+			pthread_cond_wait(&finished, &lock);
+		pthread_mutex_unlock(&lock);
+		if(jobs[i].len)
+			match = true;
+		fwrite(jobs[i].out, 1, jobs[i].len, stdout);
+	}
+	if(manifest)
+		writemanifest();
 
 	return match ? 0 : 1;
 }
 
 void
-test(const char *path, const char *name) {
+emit(Job *job, const char *name) {
+	size_t n = strlen(name) + 1;
+
+	if(FLAG('q'))
+		exit(0);
+	/* the manifest is line-based: such a listing is rescanned every time */
+	if(strchr(name, '\n'))
+		job->listed = false;
+	if(job->len + n > job->cap) {
+		job->cap = job->cap ? 2 * job->cap + n : BUFSIZ + n;
+		if(!(job->out = realloc(job->out, job->cap))) {
+			perror("realloc");
+			exit(2);
+		}
+	}
+	memcpy(&job->out[job->len], name, n - 1);
+	job->out[job->len + n - 1] = '\n';
+	job->len += n;
+}
+
+void
+readmanifest(void) {
+	char *buf, *p, *q, *end;
+	size_t size = 0, n;
+	Entry *e;
+	FILE *fp;
+
+	/* one entry per directory: "sec nsec flags\tpath", its names, a blank line */
+	if(!(fp = fopen(manifest, "r")))
+		return;
+	if(!(buf = malloc(BUFSIZ))) {
+		perror("malloc");
+		exit(2);
+	}
+	while((n = fread(&buf[size], 1, BUFSIZ, fp)) > 0)
+		if(!(buf = realloc(buf, (size += n) + BUFSIZ))) {
+			perror("realloc");
+			exit(2);
+		}
+	fclose(fp);
+	buf[size] = '\0';
+	for(p = buf, end = buf + size; p < end; p = q + 1) {
+		if(!(entries = realloc(entries, (nentries + 1) * sizeof *entries))) {
+			perror("realloc");
+			exit(2);
+		}
+		e = &entries[nentries];
+		e->mtime.tv_sec = strtoll(p, &p, 10);
+		e->mtime.tv_nsec = strtol(p, &p, 10);
+		if(*p++ != ' ' || !(q = strchr(p, '\t')))
+			return; /* damaged: rescan what is left */
+		*q = '\0';
+		e->flags = p;
+		e->path = q + 1;
+		if(!(q = strchr(e->path, '\n')))
+			return;
+		*q = '\0';
+		for(e->names = q + 1, q = e->names; q < end && *q != '\n'; q++)
+			if(!(q = strchr(q, '\n')))
+				return;
+		if(q >= end)
+			return;
+		e->len = q - e->names;
+		nentries++;
+	}
+}
+
+void
+scan(Job *job) {
+	struct dirent *d;
+	struct stat st;
+	size_t i;
+	DIR *dir;
+
+	if(manifest && !strchr(job->arg, '\n') && !stat(job->arg, &st) && S_ISDIR(st.st_mode)) {
+		/* an unchanged directory lists what it did last time */
+		job->listed = true;
+		job->mtime = st.st_mtim;
+		for(i = 0; i < nentries; i++)
+			if(!strcmp(entries[i].path, job->arg) && !strcmp(entries[i].flags, flags)
+			&& entries[i].mtime.tv_sec == st.st_mtim.tv_sec
+			&& entries[i].mtime.tv_nsec == st.st_mtim.tv_nsec) {
+				if(FLAG('q') && entries[i].len)
+					exit(0);
+				job->out = entries[i].names;
+				job->len = entries[i].len;
+				job->cached = true;
+				return;
+			}
+	}
+	if(FLAG('l') && (dir = opendir(job->arg))) {
+		/* test directory contents, relative to the directory */
+		while((d = readdir(dir)))
+			if(test(dirfd(dir), d->d_name, d->d_name, d->d_type))
+				emit(job, d->d_name);
+		closedir(dir);
+	}
+	else if(test(AT_FDCWD, job->arg, job->arg, DT_UNKNOWN))
+		emit(job, job->arg);
+}
+
+bool
+test(int dir, const char *path, const char *name, unsigned char type) {
 	struct stat st, ln;
 
-	if(!stat(path, &st) && (FLAG('a') || name[0] != '.')          /* hidden files      */
-	&& (!FLAG('b') || S_ISBLK(st.st_mode))                        /* block special     */
+	if(!FLAG('a') && name[0] == '.')                              /* hidden files      */
+		return false;
+	/* the entry's type from readdir() will do, unless it is a link to
+	 * follow or a test needs more of the inode */
+	if(type == DT_UNKNOWN || type == DT_LNK
+	|| FLAG('g') || FLAG('n') || FLAG('o') || FLAG('s') || FLAG('u')) {
+		if(fstatat(dir, path, &st, 0))
+			return false;
+	}
+	else {
+		memset(&st, 0, sizeof st);
+		st.st_mode = DTTOIF(type);
+	}
+	return (!FLAG('b') || S_ISBLK(st.st_mode))                    /* block special     */
 	&& (!FLAG('c') || S_ISCHR(st.st_mode))                        /* character special */
 	&& (!FLAG('d') || S_ISDIR(st.st_mode))                        /* directory         */
-	&& (!FLAG('e') || access(path, F_OK) == 0)                    /* exists            */
+	&& (!FLAG('e') || faccessat(dir, path, F_OK, 0) == 0)         /* exists            */
 	&& (!FLAG('f') || S_ISREG(st.st_mode))                        /* regular file      */
 	&& (!FLAG('g') || st.st_mode & S_ISGID)                       /* set-group-id flag */
-	&& (!FLAG('h') || (!lstat(path, &ln) && S_ISLNK(ln.st_mode))) /* symbolic link     */
+	&& (!FLAG('h') || (type != DT_UNKNOWN ? type == DT_LNK        /* symbolic link     */
+	                   : (!fstatat(dir, path, &ln, AT_SYMLINK_NOFOLLOW) && S_ISLNK(ln.st_mode))))
 	&& (!FLAG('n') || st.st_mtime > new.st_mtime)                 /* newer than file   */
 	&& (!FLAG('o') || st.st_mtime < old.st_mtime)                 /* older than file   */
 	&& (!FLAG('p') || S_ISFIFO(st.st_mode))                       /* named pipe        */
-	&& (!FLAG('r') || access(path, R_OK) == 0)                    /* readable          */
+	&& (!FLAG('r') || faccessat(dir, path, R_OK, 0) == 0)         /* readable          */
 	&& (!FLAG('s') || st.st_size > 0)                             /* not empty         */
 	&& (!FLAG('u') || st.st_mode & S_ISUID)                       /* set-user-id flag  */
-	&& (!FLAG('w') || access(path, W_OK) == 0)                    /* writable          */
-	&& (!FLAG('x') || access(path, X_OK) == 0)) {                 /* executable        */
-		if(FLAG('q'))
-			exit(0);
-		match = true;
-		puts(name);
+	&& (!FLAG('w') || faccessat(dir, path, W_OK, 0) == 0)         /* writable          */
+	&& (!FLAG('x') || faccessat(dir, path, X_OK, 0) == 0);        /* executable        */
+}
+
+void *
+walk(void *arg) {
+	size_t i;
+
+	(void)arg;
+	for(;;) {
+		pthread_mutex_lock(&lock);
+		i = nextjob++;
+		pthread_mutex_unlock(&lock);
+		if(i >= njobs)
+			return NULL;
+		scan(&jobs[i]);
+		pthread_mutex_lock(&lock);
+		jobs[i].done = true;
+		pthread_cond_broadcast(&finished);
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+void
+writemanifest(void) {
+	char tmp[PATH_MAX];
+	size_t i, n = 0;
+	bool stale = false;
+	FILE *fp;
+	int fd;
+
+	for(i = 0; i < njobs; i++)
+		if(jobs[i].listed) {
+			n++;
+			stale = stale || !jobs[i].cached;
+		}
+	if(!stale && n == nentries)
+		return;
+	/* written beside the old one and renamed over it */
+	if(snprintf(tmp, sizeof tmp, "%s.XXXXXX", manifest) >= (int)sizeof tmp
+	|| (fd = mkstemp(tmp)) < 0 || !(fp = fdopen(fd, "w"))) {
+		perror(manifest);
+		return;
+	}
+	for(i = 0; i < njobs; i++)
+		if(jobs[i].listed) {
+			fprintf(fp, "%lld %ld %s\t%s\n", (long long)jobs[i].mtime.tv_sec,
+			        (long)jobs[i].mtime.tv_nsec, flags, jobs[i].arg);
+			fwrite(jobs[i].out, 1, jobs[i].len, fp);
+			fputc('\n', fp);
+		}
+	if(fflush(fp) == EOF || ferror(fp) || fclose(fp) == EOF || rename(tmp, manifest)) {
+		perror(manifest);
+		unlink(tmp);
 	}
 }
@@ -0,0 +1,156 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "match.h"
+#include "trigram.h"
+#include "util.h"
+
+#define TRIGRAMBITS 20 /* trigrams sharing a bucket only add candidates */
+#define NBUCKETS    (1 << TRIGRAMBITS)
+#define MAXGRAMS    64 /* posting lists intersected per query, rarest first */
+
+static size_t bucket(const char *s);
+static int cmpsize(const void *a, const void *b);
+static uint32_t getvar(const unsigned char **p);
+static unsigned char *putvar(unsigned char *p, uint32_t v);
+static size_t varlen(uint32_t v);
+
+/* posting list of bucket b: item gaps, varint encoded, from start[b] to
+ * start[b+1]; gaps count from 1 so the first is the item index plus one */
+static uint64_t *start = NULL;
+static unsigned char *postings = NULL;
+static size_t indexed = 0; /* items covered by the index */
+static uint32_t *cand = NULL;
+static size_t candcap = 0;
+
+size_t
+bucket(const char *s) {
+	const unsigned char *u = (const unsigned char *)s;
+	uint32_t t = (uint32_t)u[0] << 16 | (uint32_t)u[1] << 8 | u[2];
+
+	return (t * 2654435761u) >> (32 - TRIGRAMBITS);
+}
+
+void
+buildtrigrams(void) {
+	uint32_t *last = NULL;
+	uint64_t *fill = NULL;
+	size_t i, j, b;
+
+	/* two passes over the folded text: size every list, then fill it */
+	free(start);
+	free(postings);
+	if (!(start = calloc(NBUCKETS + 1, sizeof *start))
+	|| !(last = calloc(NBUCKETS, sizeof *last))
+	|| !(fill = malloc(NBUCKETS * sizeof *fill)))
+		eprintf("cannot malloc %u bytes:", NBUCKETS * sizeof *start);
+	for (i = 0; i < nitems; i++)
+		for (j = 0; j + 2 < items[i].len; j++)
+			if (last[b = bucket(&items[i].fold[j])] != i + 1) {
+				start[b + 1] += varlen(i + 1 - last[b]);
+				last[b] = i + 1;
+			}
+	for (b = 0; b < NBUCKETS; b++) {
+		fill[b] = start[b];
+		start[b + 1] += start[b];
+	}
+	if (!(postings = malloc(start[NBUCKETS] + 1)))
+		eprintf("cannot malloc %lu bytes:", (unsigned long)start[NBUCKETS]);
+	memset(last, 0, NBUCKETS * sizeof *last);
+	for (i = 0; i < nitems; i++)
+		for (j = 0; j + 2 < items[i].len; j++)
+			if (last[b = bucket(&items[i].fold[j])] != i + 1) {
+				fill[b] = putvar(&postings[fill[b]], i + 1 - last[b]) - postings;
+				last[b] = i + 1;
+			}
+	free(last);
+	free(fill);
+	indexed = nitems;
+}
+
+int
+cmpsize(const void *a, const void *b) {
+	uint64_t x = start[*(const size_t *)a + 1] - start[*(const size_t *)a];
+	uint64_t y = start[*(const size_t *)b + 1] - start[*(const size_t *)b];
+
+	return (x > y) - (x < y);
+}
+
+uint32_t
+getvar(const unsigned char **p) {
+	uint32_t v = 0;
+	int shift = 0;
+
+	do
+		v |= (uint32_t)(**p & 0x7f) << shift, shift += 7;
+	while (*(*p)++ & 0x80);
+	return v;
+}
+
+unsigned char *
+putvar(unsigned char *p, uint32_t v) {
+	for (; v >= 0x80; v >>= 7)
+		*p++ = (v & 0x7f) | 0x80;
+	*p++ = v;
+	return p;
+}
+
+int
+trigramcandidates(char **tokv, const size_t *tokl, int tokc, uint32_t **out, size_t *nout) {
+	size_t grams[MAXGRAMS], ngrams = 0, i, j, k, n;
+	const unsigned char *p, *end;
+	uint32_t v;
+	int t;
+
+	/* only complete input can be answered from the index, and only
+	 * tokens of three or more bytes narrow it down */
+	if (!indexed || indexed != nitems)
+		return 0;
+	for (t = 0; t < tokc; t++)
+		for (j = 0; j + 2 < tokl[t] && ngrams < MAXGRAMS; j++) {
+			grams[ngrams] = bucket(&tokv[t][j]);
+			for (k = 0; k < ngrams && grams[k] != grams[ngrams]; k++);
+			if (k == ngrams)
+				ngrams++;
+		}
+	if (!ngrams)
+		return 0;
+	qsort(grams, ngrams, sizeof *grams, cmpsize);
+
+	/* the shortest list bounds the candidates: every gap takes a byte */
+	if (start[grams[0] + 1] - start[grams[0]] > candcap) {
+		candcap = start[grams[0] + 1] - start[grams[0]];
+		if (!(cand = realloc(cand, candcap * sizeof *cand)))
+			eprintf("cannot realloc %u bytes:", candcap * sizeof *cand);
+	}
+	p = &postings[start[grams[0]]];
+	end = &postings[start[grams[0] + 1]];
+	for (n = 0, v = 0; p < end; cand[n++] = v - 1)
+		v += getvar(&p);
+	/* intersect in place with the longer lists */
+	for (k = 1; k < ngrams && n; k++) {
+		p = &postings[start[grams[k]]];
+		end = &postings[start[grams[k] + 1]];
+		for (i = j = 0, v = 0; i < n && p < end; ) {
+			v += getvar(&p);
+			while (i < n && cand[i] < v - 1)
+				i++;
+			if (i < n && cand[i] == v - 1)
+				cand[j++] = cand[i++];
+		}
+		n = j;
+	}
+	*out = cand;
+	*nout = n;
+	return 1;
+}
+
+size_t
+varlen(uint32_t v) {
+	size_t n = 1;
+
+	while (v >>= 7)
+		n++;
+	return n;
+}
@@ -0,0 +1,7 @@
+/* See LICENSE file for copyright and license details. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+void buildtrigrams(void);
+int trigramcandidates(char **tokv, const size_t *tokl, int tokc, uint32_t **out, size_t *nout);
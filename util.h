@@ -0,0 +1,3 @@
+/* See LICENSE file for copyright and license details. */
+
+void eprintf(const char *fmt, ...);
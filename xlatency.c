@@ -0,0 +1,259 @@
+/* See LICENSE file for copyright and license details. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <X11/XKBlib.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/keysym.h>
+#include <X11/extensions/XTest.h>
+#include "util.h"
+
+#define LENGTH(x)  (sizeof (x) / sizeof *(x))
+#define MAXKEYS    4096
+#define SETTLE     0.02 /* seconds without change that end a redraw */
+#define TIMEOUT    2.0  /* keys that change nothing give up after this */
+#define STARTUP    60.0 /* large inputs are read before the window maps */
+
+typedef struct {
+	const char *name;
+	double lat[MAXKEYS];
+	size_t n, timeouts;
+} Scenario;
+
+static int cmpdouble(const void *a, const void *b);
+static Window findmenu(Window w);
+static XImage *grab(void);
+static void key(Scenario *s, KeySym sym);
+static double now(void);
+static void report(Scenario *s);
+static Bool same(XImage *a, XImage *b);
+static XImage *settle(void);
+static void usage(void);
+
+static const char *queries[16] = { "/ba", "kilo", "tr.c", "qzxjvk" };
+static size_t nqueries = 4;
+static Scenario typing = { "typing" }, paging = { "paging" };
+static Scenario end = { "end" }, home = { "home" };
+static Display *dpy;
+static Window win;
+static unsigned int ww, wh;
+
+int
+cmpdouble(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+Window
+findmenu(Window w) {
+	Window root, parent, *kids, found = None;
+	XWindowAttributes wa;
+	XClassHint hint;
+	unsigned int i, n;
+
+	/* the menu is the mapped window named "dmenu", not its dim window */
+	if (XGetWindowAttributes(dpy, w, &wa) && wa.map_state == IsViewable
+	&& XGetClassHint(dpy, w, &hint)) {
+		if (hint.res_name && !strcmp(hint.res_name, "dmenu"))
+			found = w;
+		XFree(hint.res_name);
+		XFree(hint.res_class);
+		if (found)
+			return found;
+	}
+	if (!XQueryTree(dpy, w, &root, &parent, &kids, &n))
+		return None;
+	for (i = 0; i < n && !found; i++)
+		found = findmenu(kids[i]);
+	if (kids)
+		XFree(kids);
+	return found;
+}
+
+XImage *
+grab(void) {
+	XImage *img;
+
+	/* a round trip, so everything dmenu drew before it is in the image */
+	if (!(img = XGetImage(dpy, win, 0, 0, ww, wh, AllPlanes, ZPixmap)))
+		eprintf("cannot read the menu window\n");
+	return img;
+}
+
+void
+key(Scenario *s, KeySym sym) {
+	KeyCode kc, shift = 0;
+	XImage *before, *after;
+	double t;
+
+	if (!(kc = XKeysymToKeycode(dpy, sym)))
+		eprintf("no keycode for %s\n", XKeysymToString(sym));
+	if (XkbKeycodeToKeysym(dpy, kc, 0, 0) != sym)
+		shift = XKeysymToKeycode(dpy, XK_Shift_L);
+	before = settle();
+	if (shift)
+		XTestFakeKeyEvent(dpy, shift, True, CurrentTime);
+	XTestFakeKeyEvent(dpy, kc, True, CurrentTime);
+	XTestFakeKeyEvent(dpy, kc, False, CurrentTime);
+	if (shift)
+		XTestFakeKeyEvent(dpy, shift, False, CurrentTime);
+	t = now();
+	XFlush(dpy);
+	for (;;) {
+		after = grab();
+		if (!same(before, after)) {
+			if (s->n < LENGTH(s->lat))
+				s->lat[s->n++] = now() - t;
+			break;
+		}
+		XDestroyImage(after);
+		after = NULL;
+		if (now() - t > TIMEOUT) {
+			s->timeouts++;
+			break;
+		}
+	}
+	XDestroyImage(before);
+	if (after)
+		XDestroyImage(after);
+}
+
+double
+now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void
+report(Scenario *s) {
+	if (!s->n) {
+		printf("scenario=%s keys=0 timeouts=%lu\n", s->name, (unsigned long)s->timeouts);
+		return;
+	}
+	qsort(s->lat, s->n, sizeof *s->lat, cmpdouble);
+	printf("scenario=%s keys=%lu p50=%.3fms p99=%.3fms max=%.3fms timeouts=%lu\n",
+	       s->name, (unsigned long)s->n, s->lat[s->n / 2] * 1e3,
+	       s->lat[s->n * 99 / 100] * 1e3, s->lat[s->n - 1] * 1e3, (unsigned long)s->timeouts);
+}
+
+Bool
+same(XImage *a, XImage *b) {
+	return a->bytes_per_line == b->bytes_per_line
+	    && !memcmp(a->data, b->data, (size_t)a->bytes_per_line * a->height);
+}
+
+XImage *
+settle(void) {
+	XImage *prev, *img;
+
+	/* wait out the previous key's redraws before taking the baseline */
+	for (prev = grab();; prev = img) {
+		usleep(SETTLE * 1e6);
+		img = grab();
+		if (same(prev, img))
+			break;
+		XDestroyImage(prev);
+	}
+	XDestroyImage(prev);
+	return img;
+}
+
+void
+usage(void) {
+	fputs("usage: xlatency [-p PAGES] [-q QUERY]... [dmenu [ARGS...]]\n", stderr);
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[]) {
+	char *deflt[] = { "./dmenu", "-l", "20", NULL }, **cmd = deflt;
+	int i, ev, err, major, minor, pages = 20, custom = 0;
+	XWindowAttributes wa;
+	const char *p;
+	double t;
+	pid_t pid;
+	size_t q;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++)
+		if (i + 1 == argc)
+			usage();
+		else if (!strcmp(argv[i], "-p"))
+			pages = atoi(argv[++i]);
+		else if (!strcmp(argv[i], "-q")) {
+			/* given queries replace the defaults */
+			if (!custom++)
+				nqueries = 0;
+			if (nqueries < LENGTH(queries))
+				queries[nqueries++] = argv[++i];
+		}
+		else
+			usage();
+	if (i < argc)
+		cmd = &argv[i];
+
+	/* Xvfb may still be starting */
+	for (t = now(); !(dpy = XOpenDisplay(NULL)); usleep(100000))
+		if (now() - t > 10)
+			eprintf("cannot open display\n");
+	if (!XTestQueryExtension(dpy, &ev, &err, &major, &minor))
+		eprintf("no XTest extension\n");
+
+	/* dmenu inherits our stdin, the corpus */
+	t = now();
+	if ((pid = fork()) < 0)
+		eprintf("cannot fork:");
+	if (pid == 0) {
+		execvp(cmd[0], cmd);
+		eprintf("cannot run %s:", cmd[0]);
+	}
+	close(STDIN_FILENO);
+	while (!(win = findmenu(DefaultRootWindow(dpy)))) {
+		if (waitpid(pid, NULL, WNOHANG) == pid)
+			eprintf("%s exited before mapping its window\n", cmd[0]);
+		if (now() - t > STARTUP)
+			eprintf("%s did not map a window\n", cmd[0]);
+		usleep(1000);
+	}
+	printf("startup=%.3fms\n", (now() - t) * 1e3);
+	XGetWindowAttributes(dpy, win, &wa);
+	ww = wa.width;
+	wh = wa.height;
+
+	/* type every query a key at a time, then erase it */
+	for (q = 0; q < nqueries; q++) {
+		for (p = queries[q]; *p; p++)
+			key(&typing, (unsigned char)*p); /* Latin-1 keysyms are their characters */
+		for (p = queries[q]; *p; p++)
+			key(&typing, XK_BackSpace);
+	}
+	/* page through the unfiltered list and back */
+	for (i = 0; i < pages; i++)
+		key(&paging, XK_Next);
+	for (i = 0; i < pages; i++)
+		key(&paging, XK_Prior);
+	/* jump to the end of the list and back */
+	for (i = 0; i < 5; i++) {
+		key(&end, XK_End);
+		key(&home, XK_Home);
+	}
+
+	report(&typing);
+	report(&paging);
+	report(&end);
+	report(&home);
+	fflush(stdout);
+
+	XTestFakeKeyEvent(dpy, XKeysymToKeycode(dpy, XK_Escape), True, CurrentTime);
+	XTestFakeKeyEvent(dpy, XKeysymToKeycode(dpy, XK_Escape), False, CurrentTime);
+	XFlush(dpy);
+	waitpid(pid, NULL, 0);
+	XCloseDisplay(dpy);
+	return EXIT_SUCCESS;
+}